@@ -0,0 +1,210 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Generator of large synthetic assembly programs for benchmarking the
+assembler. The output is meant to look like hand-written code at any size:
+functions made of short labelled blocks, forward and backward blez/jmp/la
+references to nearby blocks (within the reach of the 8-bit offsets), .word
+tables, full-line and trailing comments, blank lines, and indentation and
+operand spacing that vary from line to line. The same seed always gives the
+same program.
+
+The assembler accepts programs of any size, but only the first 128 words fit
+in the simulator's memory; these programs are for the assembler only. With
+-b only the instructions of the original instruction set are used (no xchg),
+so that assemblers of any revision can be compared on the output.
+*/
+
+#define BLOCK_WORDS 10  // at most this many words per block, so +-8 blocks is within a branch offset
+
+uint64_t rng_state;
+int baseline = 0;  // -b: no instructions added after the original instruction set
+
+uint64_t rng(void);
+int rng_range(int, int);
+const char* indent(void);
+const char* reg(void);
+const char* comma(void);
+void emit_instruction(FILE*, long, long);
+void emit_comment(FILE*);
+
+int main(int argc, char** args) {
+    long lines, n_blocks, b;
+    uint64_t seed = 1;
+
+    while (argc > 1 && args[1][0] == '-') {
+        if (!strcmp(args[1], "-s") && argc > 2) {
+            seed = strtoull(args[2], NULL, 10);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-b")) {
+            baseline = 1;
+            args++, argc--;
+        } else
+            break;
+    }
+    if (argc != 2 || (lines = atol(args[1])) <= 0) {
+        printf("Usage: %s [-s seed] [-b] lines > program.asm\n", args[0]);
+        printf("\t lines: approximate number of lines to generate; seed: default 1\n");
+        printf("\t -b: original instruction set only (lw instead of xchg), for older assemblers\n");
+        exit(-1);
+    }
+    rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+    // A block is about 7.5 lines on average (label, instructions, comments, blank lines)
+    n_blocks = lines * 2 / 15 + 1;
+    fprintf(stdout, ";;; synthetic program generated by asmgen (seed %llu, %ld blocks)\n", (unsigned long long) seed,
+            n_blocks);
+    fprintf(stdout, ".word 0%s; ISR address\n\n", indent());
+
+    for (b = 0; b < n_blocks; b++) {
+        // Every random choice is drawn into a variable first, as the order in which function
+        // arguments are evaluated is unspecified and the output must only depend on the seed
+        int n, i, indented = rng() % 4, commented = rng() % 8;
+        if (b % 32 == 0)
+            fprintf(stdout, "\n;;; function %ld\nfunc_%ld:\n", b / 32, b / 32);
+        fprintf(stdout, "%sblk_%ld:%s\n", indented ? "" : "  ", b, commented ? "" : "    ; block start");
+
+        if (rng() % 6 == 0) {
+            // a data table, reachable with la from the neighbouring blocks
+            n = rng_range(1, BLOCK_WORDS);
+            for (i = 0; i < n; i++) {
+                const char* in = indent();
+                int tab = rng() % 2, value = rng_range(-100000, 100000);
+                fprintf(stdout, "%s.word%s%d%s\n", in, tab ? "\t" : " ", value, (rng() % 5) ? "" : "   ; table entry");
+            }
+        } else {
+            n = rng_range(1, BLOCK_WORDS - 1);
+            for (i = 0; i < n; i++) {
+                if (rng() % 7 == 0)
+                    emit_comment(stdout);
+                emit_instruction(stdout, b, n_blocks);
+            }
+            // most blocks end in a branch, so there are back edges and forward edges
+            long t = b + rng_range(-8, 8);
+            if (t < 0 || t >= n_blocks)
+                t = b;
+            if (rng() % 3) {
+                const char* in = indent();
+                fprintf(stdout, "%sjmp%sblk_%ld\n", in, (rng() % 2) ? " " : "\t", t);
+            }
+        }
+        if (rng() % 3 == 0)
+            fprintf(stdout, "\n");
+    }
+    fprintf(stdout, "\nend:\n%shalt\n", indent());
+    return 0;
+}
+
+/*
+xorshift64*
+*/
+uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+int rng_range(int lo, int hi) {
+    return lo + (int) (rng() % (uint64_t) (hi - lo + 1));
+}
+
+const char* indent(void) {
+    static const char* s[] = {"    ", "    ", "    ", "\t", "  ", "        ", "\t  "};
+    return s[rng() % 7];
+}
+
+const char* reg(void) {
+    static char s[2][4];  // emit_instruction() holds two at a time
+    static int k = 0;
+    k = !k;
+    if (rng() % 16 == 0)
+        return "sp";
+    snprintf(s[k], sizeof(s[k]), "R%d", rng_range(0, (rng() % 4) ? 7 : 63));
+    return s[k];
+}
+
+const char* comma(void) {
+    static const char* s[] = {", ", ", ", ",", " , ", ",\t"};
+    return s[rng() % 5];
+}
+
+void emit_instruction(FILE* fp, long b, long n_blocks) {
+    const char* in = indent();
+    long t = b + rng_range(-8, 8);
+    if (t < 0 || t >= n_blocks)
+        t = b;
+    const char* r1 = reg();
+    const char* c1 = comma();
+    const char* r2 = reg();
+    const char* c2 = comma();
+    int imm = rng_range(-128, 127), offset = rng_range(-16, 16);
+
+    switch (rng() % 20) {
+    case 0:
+    case 1:
+        fprintf(fp, "%saddi    %s%s%s%s%d", in, r1, c1, r2, c2, imm);
+        break;
+    case 2:
+    case 3:
+        fprintf(fp, "%smovei   %s%s%d", in, r1, c1, imm);
+        break;
+    case 4:
+        fprintf(fp, "%smove_reg %s%s%s", in, r1, c1, r2);
+        break;
+    case 5:
+    case 6:
+        fprintf(fp, "%slw      %s%s%s%s%d", in, r1, c1, r2, c2, offset);
+        break;
+    case 7:
+        fprintf(fp, "%ssw      %s%s%s%s%d", in, r1, c1, r2, c2, offset);
+        break;
+    case 8:
+    case 9:
+        fprintf(fp, "%sblez    %s%sblk_%ld", in, r1, c1, t);
+        break;
+    case 10:
+        fprintf(fp, "%sla      %s%sblk_%ld", in, r1, c1, t);
+        break;
+    case 11:
+    case 12:
+        fprintf(fp, "%sadd     %s%s%s", in, r1, c1, r2);
+        break;
+    case 13:
+        fprintf(fp, "%spush    %s", in, r1);
+        break;
+    case 14:
+        fprintf(fp, "%spop     %s", in, r1);
+        break;
+    case 15:
+        fprintf(fp, "%sput     %s", in, r1);
+        break;
+    case 16:
+        fprintf(fp, "%s%s%s%s%s%s%d", in, baseline ? "lw      " : "xchg    ", r1, c1, r2, c2, offset);
+        break;
+    case 17:
+        fprintf(fp, "%sNOP", in);
+        break;
+    case 18:
+        fprintf(fp, "%siret", in);
+        break;
+    default:
+        fprintf(fp, "%sjmp     blk_%ld", in, t);
+    }
+    if (rng() % 4 == 0) {
+        int tabs = rng() % 2;
+        fprintf(fp, "%s; %s", tabs ? "\t\t" : "  ", (rng() % 2) ? "update the counter" : "see above");
+    } else if (rng() % 8 == 0)
+        fprintf(fp, "   ");  // trailing whitespace
+    fprintf(fp, "\n");
+}
+
+void emit_comment(FILE* fp) {
+    static const char* s[] = {";; save the registers we use", ";;; next step", "; loop until the counter is zero",
+                              ";; restore", ";"};
+    const char* in = (rng() % 2) ? indent() : "";
+    fprintf(fp, "%s%s\n", in, s[rng() % 5]);
+}
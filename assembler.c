@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L  // getline(), clock_gettime()
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -5,13 +7,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_ASSEMBLY_SIZE 2048   // maximum number of lines of assembly file
-#define MAX_ASSEMBLY_LENGTH 128  // maximum length of a line
-#define MAX_LABEL_SIZE 1024      // maximum number of labels
-#define MAX_LABEL_LENGTH 30      // maximum length of label
+#include "coverage.h"
+#include "image.h"
+
+#define MAX_LABEL_LENGTH 30    // maximum length of label
+#define ARENA_BLOCK (1 << 20)  // bytes per arena block holding the text of code lines and labels
 
 enum {
     OP_HALT = 0x00,
@@ -29,6 +34,7 @@ enum {
     OP_JMP = 0x0c,
     OP_IRET = 0x10,
     OP_PUT = 0x11,
+    OP_XCHG = 0x12,
     OP_NONE = 0xff,
 };
 
@@ -46,29 +52,73 @@ int parse_sti(char*, uint8_t*, uint8_t*, int8_t*);
 void throw_syntax_error(int);
 void print_label_table();
 void print_code();
-char code[MAX_ASSEMBLY_SIZE][MAX_ASSEMBLY_LENGTH];  // code table
-char label[MAX_LABEL_SIZE][MAX_LABEL_LENGTH];       // label table
-int label_address[MAX_LABEL_SIZE];                  // label address table
-int code_size = 0, label_size = 0;
+void write_image(FILE*, uint8_t*);
+void print_coverage(char*, char*, uint8_t*);
+char* arena_strndup(const char*, size_t);
+void build_label_index();
+uint32_t label_hash(const char*);
+double now();
+
+/*
+The tables grow as needed; their strings live in an arena that is never freed
+or moved, so a big program costs one allocation per megabyte of text rather
+than one per line.
+*/
+char** code = NULL;          // code table
+int* code_line = NULL;       // source line number of each code table entry
+char** label = NULL;         // label table
+int* label_address = NULL;   // label address table
+int* label_index = NULL;     // hash table of label numbers (-1: empty), built after phase 1
+uint32_t label_index_mask = 0;
+int code_size = 0, label_size = 0, code_cap = 0, label_cap = 0;
+int line_number = 0;  // source line being handled in phase 1
+char* entry_label = NULL;  // label named by .entry, NULL: start at the first instruction
+int entry_address = -1;
+char* arena = NULL;
+size_t arena_used = ARENA_BLOCK;
 
 int main(int argc, char** args) {
-    if (argc != 3) {
-        printf("Usage: %s assembly_prog executable_prog\n", args[0]);
+    int legacy = 0;   // -r: headerless memory dump
+    int listing = 0;  // -l: annotate the source with a coverage file
+    int stats = 0;    // -s: print sizes, time per phase and peak memory
+    while (argc > 1 && args[1][0] == '-') {
+        if (!strcmp(args[1], "-r"))
+            legacy = 1;
+        else if (!strcmp(args[1], "-l"))
+            listing = 1;
+        else if (!strcmp(args[1], "-s"))
+            stats = 1;
+        else
+            break;
+        args++, argc--;
+    }
+    if (argc != 3 || (listing && (legacy || stats))) {
+        printf("Usage: %s [-r] [-s] assembly_prog executable_prog\n", args[0]);
+        printf("       %s -l assembly_prog coverage_file\n", args[0]);
         exit(EXIT_FAILURE);
     }
+    double t_start = now(), t_phase1, t_phase2;
+    size_t n_bytes = 0;
 
     /*
     Begin Phase 1: In phase one, the assembler read the asm file, build label
     table, store code and data in 'code', and remove redundant blank lines.
     */
     FILE* fp = fopen(args[1], "r");  // Open source file
+    if (fp == NULL) {
+        printf("Error: cannot open %s\n", args[1]);
+        exit(EXIT_FAILURE);
+    }
     char* line = NULL;
     size_t len = 0;
     ssize_t read;
     int address = 0;
 
-    while ((read = getline(&line, &len, fp)) != -1)
+    while ((read = getline(&line, &len, fp)) != -1) {
+        line_number++;
+        n_bytes += read;
         handle_line(line, &address);
+    }
 
     if (line)
         free(line);
@@ -79,6 +129,12 @@ int main(int argc, char** args) {
     print_label_table();
     print_code();
 #endif
+    build_label_index();
+    if (entry_label != NULL && (entry_address = parse_label(entry_label)) == -1) {
+        printf("Error: entry label %s is not defined\n", entry_label);
+        exit(EXIT_FAILURE);
+    }
+    t_phase1 = now();
     /* End Phase 1 */
 
     /*
@@ -87,18 +143,45 @@ int main(int argc, char** args) {
     */
 
     // binary code, one line of assembly code becomes four uint8_t
-    uint8_t bin[MAX_ASSEMBLY_SIZE * 4];
+    uint8_t* bin = malloc(code_size * 4 + 4);
     int code_index = 0;
     for (; code_index < code_size; ++code_index) {
         parse(code[code_index], code_index, bin + code_index * 4);
     }
 
+    t_phase2 = now();
+
+    if (listing) {
+        print_coverage(args[1], args[2], bin);
+        return 0;
+    }
+
     // write to binary file
     FILE* fp_out = fopen(args[2], "wb");  // Open binary file for output
-    fwrite(bin, sizeof(uint8_t), code_size * 4, fp);
+    if (fp_out == NULL) {
+        printf("Error: cannot open %s\n", args[2]);
+        exit(EXIT_FAILURE);
+    }
+    if (legacy)
+        fwrite(bin, sizeof(uint8_t), code_size * 4, fp_out);
+    else
+        write_image(fp_out, bin);
     fclose(fp_out);
     /* End Phase 2 */
 
+    if (stats) {
+        double t_end = now(), total = t_end - t_start;
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        printf("--------ASSEMBLER STATISTICS--------\n");
+        printf("Input: %d lines, %zu bytes, %d words, %d labels\n", line_number, n_bytes, code_size, label_size);
+        printf("Phase 1 (read, label table): %9.3f ms\n", (t_phase1 - t_start) * 1e3);
+        printf("Phase 2 (encode):            %9.3f ms\n", (t_phase2 - t_phase1) * 1e3);
+        printf("Write:                       %9.3f ms\n", (t_end - t_phase2) * 1e3);
+        printf("Total: %.3f ms, %.0f lines/s, %.2f MB/s, peak memory %ld kB\n", total * 1e3, line_number / total,
+               n_bytes / total / 1e6, ru.ru_maxrss);
+    }
+
     return 0;
 }
 
@@ -110,14 +193,36 @@ void handle_line(char* line, int* p_address) {
         int s_index = is_symbol(line);
         if (s_index) {
             // This line is a symbol, add to symbol table
-            strncpy(label[label_size], line + i, s_index - i);
+            if (label_size == label_cap) {
+                label_cap = label_cap * 2 + 1024;
+                label = realloc(label, label_cap * sizeof(char*));
+                label_address = realloc(label_address, label_cap * sizeof(int));
+            }
+            label[label_size] = arena_strndup(line + i, s_index - i);
             label_address[label_size] = *p_address;
             label_size++;
+        } else if (!strncmp(line + i, ".entry", 6) && isspace(line[i + 6])) {
+            // .entry label: the image starts there, the line takes no memory
+            int begin = first_non_whitespace(line, i + 6), end = begin;
+            while (end != -1 && (isalnum(line[end]) || line[end] == '_'))
+                end++;
+            int rest = (end == -1) ? -1 : first_non_whitespace(line, end);
+            if (end == begin || (rest != -1 && line[rest] != ';') || entry_label != NULL) {
+                printf("Syntax Error: invalid .entry in line %d", line_number);
+                exit(EXIT_FAILURE);
+            }
+            entry_label = arena_strndup(line + begin, end - begin);
         } else {
             // the line processed is a code/data, increment address
             *p_address = *p_address + 1;
             // is assembly code/data, store for pass 2
-            strcpy(code[code_size++], line + i);
+            if (code_size == code_cap) {
+                code_cap = code_cap * 2 + 1024;
+                code = realloc(code, code_cap * sizeof(char*));
+                code_line = realloc(code_line, code_cap * sizeof(int));
+            }
+            code_line[code_size] = line_number;
+            code[code_size++] = arena_strndup(line + i, strlen(line + i));
         }
     }
 }
@@ -192,13 +297,11 @@ int first_non_whitespace(char* str, int i) {
 }
 
 void remove_whitespace(char* line) {
-    while (*line != '\0') {
-        if (isspace(*line)) {
-            for (int i = 0; i < strlen(line); ++i)
-                line[i] = line[i + 1];
-        } else
-            line++;
-    }
+    char* out = line;
+    for (; *line != '\0'; line++)
+        if (!isspace(*line))
+            *out++ = *line;
+    *out = '\0';
 }
 
 // TODO parser
@@ -389,6 +492,13 @@ void parse(char* line, int idx, uint8_t* bin) {
                 *(bin + 1) = treg;
                 *(bin + 2) = sreg;
                 *(bin + 3) = OP_ADDI;
+            } else if (!strncmp(line, "xchg", op_end_idx)) {
+                if (parse_sti(line + op_end_idx + 1, &sreg, &treg, &imm) == -1)
+                    throw_syntax_error(idx);
+                *bin = imm;
+                *(bin + 1) = treg;
+                *(bin + 2) = sreg;
+                *(bin + 3) = OP_XCHG;
             } else
                 throw_syntax_error(idx);
             return;
@@ -461,14 +571,59 @@ Loop up label tabel then return address if found
 Otherwise return -1
 */
 int parse_label(char* lab) {
-    for (int i = 0; i < label_size; ++i) {
-        if (strcmp(lab, label[i]) == 0) {
-            return label_address[i];
-        }
-    }
+    uint32_t h = label_hash(lab) & label_index_mask;
+    for (; label_index[h] != -1; h = (h + 1) & label_index_mask)
+        if (strcmp(lab, label[label_index[h]]) == 0)
+            return label_address[label_index[h]];
     return -1;
 }
 
+/*
+Open-addressing hash table over the label table, at most half full. A label
+defined twice keeps its first definition, as the linear search did.
+*/
+void build_label_index() {
+    uint32_t size = 16, h;
+    while (size < 2 * (uint32_t) label_size)
+        size *= 2;
+    label_index = malloc(size * sizeof(int));
+    memset(label_index, 0xff, size * sizeof(int));
+    label_index_mask = size - 1;
+    for (int i = 0; i < label_size; i++) {
+        for (h = label_hash(label[i]) & label_index_mask; label_index[h] != -1; h = (h + 1) & label_index_mask)
+            if (strcmp(label[i], label[label_index[h]]) == 0)
+                break;
+        if (label_index[h] == -1)
+            label_index[h] = i;
+    }
+}
+
+uint32_t label_hash(const char* s) {
+    return image_checksum((const uint8_t*) s, strlen(s));
+}
+
+/*
+Copy 'n' bytes of 's' (plus '\0') into the arena
+*/
+char* arena_strndup(const char* s, size_t n) {
+    if (arena_used + n + 1 > ARENA_BLOCK) {
+        // The rest of the current block is wasted; a line longer than a block gets its own
+        arena = malloc(n + 1 > ARENA_BLOCK ? n + 1 : ARENA_BLOCK);
+        arena_used = 0;
+    }
+    char* p = arena + arena_used;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    arena_used += n + 1;
+    return p;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 /*
 The input line is guaranteed to be a string without whitespace,
 separated by comma if needed.
@@ -476,7 +631,7 @@ Returns -1 when syntax error happed
 */
 int parse_sti(char* line, uint8_t* p_sreg, uint8_t* p_treg, int8_t* p_imm) {
     if (p_sreg != NULL && p_treg != NULL && p_imm != NULL) {
-        // lw, sw, addi
+        // lw, sw, addi, xchg
         int first_comma_sep_idx = first_char(line, 0, ',');
         if (first_comma_sep_idx == -1)
             return -1;
@@ -515,6 +670,7 @@ int parse_sti(char* line, uint8_t* p_sreg, uint8_t* p_treg, int8_t* p_imm) {
         // pop
         *p_treg = parse_reg(line, strlen(line));
     }
+    return 0;
 }
 
 void throw_syntax_error(int idx) {
@@ -534,4 +690,123 @@ void print_code() {
     for (int i = 0; i < code_size; i++) {
         printf("%s", code[i]);
     }
-}
\ No newline at end of file
+}
+
+/*
+Write the versioned image (see image.h): every run of consecutive .word lines
+becomes a data section, every run of instructions a code section, followed by
+the label table as a symbol section. The entry point is the label given by
+.entry, or else the first instruction.
+*/
+void write_image(FILE* fp_out, uint8_t* bin) {
+    IMAGE_SECTION* sec = malloc((code_size + 1) * sizeof(IMAGE_SECTION));
+    uint32_t n = 0, entry = 0, i, start;
+    int found_entry = 0;
+
+    for (i = 0; i < code_size; i = start) {
+        uint32_t type = (code[i][0] == '.') ? SECTION_DATA : SECTION_CODE;
+        if (type == SECTION_CODE && !found_entry) {
+            entry = i;
+            found_entry = 1;
+        }
+        for (start = i; start < code_size && ((code[start][0] == '.') ? SECTION_DATA : SECTION_CODE) == type;)
+            start++;
+        sec[n].type = type;
+        sec[n].addr = i;
+        sec[n].size = (start - i) * 4;
+        n++;
+    }
+    sec[n].type = SECTION_SYMBOL;
+    sec[n].addr = 0;
+    sec[n].size = label_size * sizeof(IMAGE_SYMBOL);
+    n++;
+
+    // Lay out the contents after the section table and build the body in memory for the checksum
+    uint32_t offset = sizeof(IMAGE_HEADER) + n * sizeof(IMAGE_SECTION);
+    for (i = 0; i < n; i++) {
+        sec[i].offset = offset;
+        offset += sec[i].size;
+    }
+    size_t body_size = offset - sizeof(IMAGE_HEADER);
+    uint8_t* body = calloc(1, body_size);
+    memcpy(body, sec, n * sizeof(IMAGE_SECTION));
+    for (i = 0; i < n - 1; i++)
+        memcpy(body + sec[i].offset - sizeof(IMAGE_HEADER), bin + sec[i].addr * 4, sec[i].size);
+    IMAGE_SYMBOL* sym = (IMAGE_SYMBOL*) (body + sec[n - 1].offset - sizeof(IMAGE_HEADER));
+    for (i = 0; i < label_size; i++) {
+        sym[i].addr = label_address[i];
+        strncpy(sym[i].name, label[i], IMAGE_SYMBOL_LENGTH - 1);
+    }
+
+    IMAGE_HEADER h;
+    h.magic = IMAGE_MAGIC;
+    h.version = IMAGE_VERSION;
+    h.entry = (entry_address != -1) ? (uint32_t) entry_address : entry;
+    h.n_sections = n;
+    h.checksum = image_checksum(body, body_size);
+    fwrite(&h, sizeof(h), 1, fp_out);
+    fwrite(body, 1, body_size, fp_out);
+    free(body);
+    free(sec);
+}
+
+/*
+Print the source annotated with a coverage file written by icpu -C or a
+translated program. Each line holding an instruction is prefixed with its
+address and '+' if it was executed or '#####' if it never was; blez lines also
+show which directions were seen (T taken, N not taken, - never). The image
+hash in the file is checked against the memory the source assembles to.
+*/
+void print_coverage(char* asm_file, char* cov_file, uint8_t* bin) {
+    COVERAGE_HEADER h;
+    uint8_t* cov = coverage_read(cov_file, &h);
+    if (cov == NULL) {
+        printf("Error: %s is not a coverage file\n", cov_file);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t* mem = calloc(h.n_words, 4);
+    if (code_size <= h.n_words)
+        memcpy(mem, bin, code_size * 4);
+    if (code_size > h.n_words || image_checksum(mem, h.n_words * 4) != h.image_hash) {
+        printf("Error: %s was not collected from %s\n", cov_file, asm_file);
+        exit(EXIT_FAILURE);
+    }
+    free(mem);
+
+    FILE* fp = fopen(asm_file, "r");
+    if (fp == NULL) {
+        printf("Error: cannot open %s\n", asm_file);
+        exit(EXIT_FAILURE);
+    }
+    char* line = NULL;
+    size_t len = 0;
+    int n = 0, i = 0, n_instr = 0, n_exec = 0, n_dir = 0, n_dir_seen = 0;
+
+    while (getline(&line, &len, fp) != -1) {
+        n++;
+        while (i < code_size && code_line[i] < n)
+            i++;
+        if (i == code_size || code_line[i] != n || code[i][0] == '.') {
+            printf("%5s %2s %4s  %s", "", "", "", line);  // blank, comment, label or data
+            continue;
+        }
+        uint8_t c = cov[i];
+        char dir[3] = "";
+        n_instr++;
+        n_exec += (c & COV_EXEC) != 0;
+        if (bin[i * 4 + 3] == OP_BLEZ) {
+            dir[0] = (c & COV_TAKEN) ? 'T' : '-';
+            dir[1] = (c & COV_NOT_TAKEN) ? 'N' : '-';
+            n_dir += 2;
+            n_dir_seen += ((c & COV_TAKEN) != 0) + ((c & COV_NOT_TAKEN) != 0);
+        }
+        printf("%5s %2s %4d: %s", (c & COV_EXEC) ? "+" : "#####", dir, i, line);
+    }
+    free(line);
+    fclose(fp);
+
+    printf("\nRuns: %u\n", h.runs);
+    printf("Instructions executed: %d of %d (%.1f%%)\n", n_exec, n_instr, n_instr ? 100.0 * n_exec / n_instr : 0);
+    printf("Branch directions taken: %d of %d (%.1f%%)\n", n_dir_seen, n_dir, n_dir ? 100.0 * n_dir_seen / n_dir : 0);
+    free(cov);
+}
@@ -0,0 +1,115 @@
+/*
+Guest code coverage file shared by the simulator (which writes it), the
+translated programs (which write the same layout) and the assembler (which
+turns it into an annotated listing).
+
+    COVERAGE_HEADER
+    uint8_t bits[n_words]             COV_* bits of every memory word
+
+Results of several runs of the same image are merged by OR-ing the bits; the
+image hash makes sure runs of different programs are never mixed.
+*/
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#define COVERAGE_MAGIC 0x564f4358  // "XCOV" in file byte order
+#define COVERAGE_VERSION 1
+
+enum {
+    COV_EXEC = 0x1,       // the instruction at this address was executed
+    COV_TAKEN = 0x2,      // blez at this address jumped
+    COV_NOT_TAKEN = 0x4,  // blez at this address fell through
+};
+
+typedef struct coverage_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_words;
+    uint32_t image_hash;  // image_checksum() of the initial memory
+    uint32_t runs;        // number of runs merged into the file
+} COVERAGE_HEADER;
+
+/*
+Read the coverage in an open file. Returns the bits (malloc'ed) and fills in
+'h', or NULL if the file is empty or not a coverage file.
+*/
+static inline uint8_t* coverage_read_fd(int fd, COVERAGE_HEADER* h) {
+    uint8_t* bits = NULL;
+    if (read(fd, h, sizeof(*h)) == sizeof(*h) && h->magic == COVERAGE_MAGIC && h->version == COVERAGE_VERSION) {
+        bits = calloc(h->n_words, 1);
+        if (read(fd, bits, h->n_words) != h->n_words) {
+            free(bits);
+            bits = NULL;
+        }
+    }
+    return bits;
+}
+
+static inline uint8_t* coverage_read(const char* file, COVERAGE_HEADER* h) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    uint8_t* bits = coverage_read_fd(fd, h);
+    close(fd);
+    return bits;
+}
+
+/*
+Merge the bits of one run into 'file', creating it if needed. The file is
+locked while it is updated, so any number of runs can merge into it at once.
+Returns -1 (after printing why) if the file is not a coverage file, belongs
+to another image or cannot be written.
+*/
+static inline int coverage_merge(const char* file, uint32_t image_hash, const uint8_t* bits, uint32_t n_words) {
+    COVERAGE_HEADER h;
+    uint32_t i;
+    int fd = open(file, O_RDWR | O_CREAT, 0644);
+
+    if (fd < 0 || flock(fd, LOCK_EX) < 0) {
+        printf("Error: cannot open %s\n", file);
+        return -1;
+    }
+    uint8_t* old = coverage_read_fd(fd, &h);
+    if (old == NULL && lseek(fd, 0, SEEK_END) > 0) {
+        printf("Error: %s exists and is not a coverage file\n", file);
+        close(fd);
+        return -1;
+    }
+    if (old != NULL && (h.n_words != n_words || h.image_hash != image_hash)) {
+        printf("Error: %s holds coverage of another image\n", file);
+        free(old);
+        close(fd);
+        return -1;
+    }
+    if (old == NULL) {
+        h.magic = COVERAGE_MAGIC;
+        h.version = COVERAGE_VERSION;
+        h.n_words = n_words;
+        h.image_hash = image_hash;
+        h.runs = 0;
+        old = calloc(n_words, 1);
+    }
+    for (i = 0; i < n_words; i++)
+        old[i] |= bits[i];
+    h.runs++;
+
+    int ret = 0;
+    lseek(fd, 0, SEEK_SET);
+    if (write(fd, &h, sizeof(h)) != sizeof(h) || write(fd, old, n_words) != n_words ||
+        ftruncate(fd, sizeof(h) + n_words) < 0) {
+        printf("Error: cannot write %s\n", file);
+        ret = -1;
+    }
+    close(fd);  // also releases the lock
+    free(old);
+    return ret;
+}
+
+#endif
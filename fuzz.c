@@ -0,0 +1,1093 @@
+#define _GNU_SOURCE  // open_memstream(), mkdtemp()
+
+// The fuzzer drives the simulator's own functions, so it is built from the same source
+#define main icpu_main
+#include "simulator-interrupt.c"
+#undef main
+
+#include <time.h>
+
+/*
+Differential fuzzer: generates random valid programs and runs every one on
+the reference loop (fetch/decode/execute/timer_tick/check_interrupt called
+one cycle at a time) and on each faster engine:
+
+    run          computer_run(), the normal run loop, with coverage
+    instrumented computer_run() with coverage and watches on words the program
+                 uses, whose conditions never hold: the cycles that reach
+                 them are run by computer_run_instrumented()
+    replay       replay_seek() from checkpoints and interrupts of the reference
+    round-robin  run_round_robin() on 2-4 cores sharing memory
+    parallel     run_parallel() on 2-3 cores, each with its own data area
+    translator   itrans -d, compiled with $CC (every -t N-th halting program)
+
+Every engine but the translator calls the same fetch(), decode() and
+execute() as the reference, so those comparisons check what is built around
+them (run loops, timer countdown, interrupt entry, coverage, checkpoints,
+scheduling), not the instructions; only the translator implements every
+instruction separately.
+
+The single-core engines run in lockstep with the reference, a random number of
+cycles at a time, and PC, PSR, counter, registers, memory and console output
+are compared after every such block; the other programs are compared when
+they end. The parallel engine runs cores that share only the code, so their
+final states must match the reference; their console output interleaves in
+any order and only the bytes written are compared. A failing case is minimized by cutting its cycle limit
+and replacing instructions with halt while it still fails, then written out as
+an image that icpu runs directly.
+
+Generated programs follow the conventions of the sample programs: the ISR
+address is at word 0, every core gets its own stack (set up with la sp), loads
+and stores go through a base register into a data area (a few go to the
+device window, where there are no devices), and only counted loops jump
+backwards. Programs use FUZZ_REGS registers and sp, so a specialized
+build (ifuzz-4p) runs them on its own machine. The reference checks every memory access and rejects a case
+that would leave memory or write over its own code.
+*/
+
+#define FUZZ_STACK_SIZE 8   // words per core: interrupt entry, ISR and program pushes
+#define FUZZ_LOOPS 4        // loop counter words per core, right above its stack
+#define FUZZ_DATA_SIZE 16   // words reachable with lw/sw/xchg
+#define FUZZ_MIN_CYCLES 1000
+#define FUZZ_MAX_CYCLES 30000
+#define FUZZ_MAX_CHUNK 128     // cycles run between two comparisons
+#define FUZZ_CK_INTERVAL 8     // chunks between two replay checkpoints
+#define FUZZ_SCRATCH (MAX_MEM_SIZE - 1)  // never used by a program
+#define FUZZ_TRANSLATOR "./itrans"
+#if GP_REGS >= 64
+#define FUZZ_REGS 8             // R0 to R(FUZZ_REGS - 1) hold random values
+#define FUZZ_BASE 63            // register holding the address of the data area
+#else
+#define FUZZ_REGS (GP_REGS - 1)
+#define FUZZ_BASE (GP_REGS - 1)
+#endif
+#ifdef MACHINE
+#define FUZZ_NAME "ifuzz-" MACHINE
+#define FUZZ_ICPU "icpu-" MACHINE
+#else
+#define FUZZ_NAME "ifuzz"
+#define FUZZ_ICPU "icpu"
+#endif
+
+enum {
+    ENGINE_RUN,
+    ENGINE_INSTRUMENTED,
+    ENGINE_REPLAY,
+    ENGINE_ROUND_ROBIN,
+    ENGINE_PARALLEL,
+    ENGINE_TRANSLATOR,
+    N_ENGINES,
+};
+
+const char* engine_name[N_ENGINES] = {"run", "instrumented", "replay", "round-robin", "parallel",
+                                    "translator"};
+
+typedef struct fuzz_case {
+    uint64_t seed;
+    uint32_t mem[MAX_MEM_SIZE];
+    uint32_t entry;
+    uint32_t code_start, code_end;  // words holding instructions
+    int n_cores;
+    int private_data;  // every core has its own data area, also run in parallel
+    uint64_t quantum;  // round-robin turn, multi-core cases only
+    uint64_t cycles;   // cycle limit per core
+} FUZZ_CASE;
+
+typedef struct fuzz_result {
+    int invalid;      // the reference left memory or wrote over code
+    int halted;       // every core halted before the cycle limit
+    int translated;   // the translator was run
+    int engine;       // first engine that disagreed, -1 if none
+    uint64_t counter; // reference cycle at which it was noticed
+    uint64_t cycles;      // cycles run by the reference, all cores
+    uint64_t interrupts;  // interrupts taken by the reference, single-core cases
+    char why[160];
+} FUZZ_RESULT;
+
+typedef struct fuzz_stats {
+    uint64_t cases, invalid, halted, multi_core, parallel, translated, failures, cycles, interrupts;
+} FUZZ_STATS;
+
+typedef struct console {
+    FILE* fp;
+    char* buf;
+    size_t size;
+} CONSOLE;
+
+uint64_t rng_state;
+int translate_every = 0;  // -t: run the translator on every N-th halting case, 0: never
+int multi_core = 1;       // -1: single-core cases only
+char work_dir[64];        // per-worker directory for translated programs
+int64_t ref_watch[2] = {-1, -1};  // words whose reads and writes fuzz_step() counts in ref_watch_hits
+uint64_t ref_watch_hits[2];
+volatile uint64_t current_seed;
+
+uint64_t rng(void);
+int rng_range(int, int);
+uint32_t encode(uint8_t, uint8_t, uint8_t, int8_t);
+void fuzz_generate(FUZZ_CASE*, uint64_t);
+int fuzz_step(COMPUTER*, FUZZ_CASE*, TRACE*);
+int fuzz_check(FUZZ_CASE*, int, FUZZ_RESULT*);
+int fuzz_check_single(FUZZ_CASE*, FUZZ_RESULT*);
+int fuzz_check_multi(FUZZ_CASE*, FUZZ_RESULT*);
+int fuzz_check_translator(FUZZ_CASE*, COMPUTER*, CONSOLE*, FUZZ_RESULT*);
+int fuzz_compare(COMPUTER*, COMPUTER*, CONSOLE*, CONSOLE*, int, FUZZ_RESULT*);
+int fuzz_state(COMPUTER*, FILE*);
+int fuzz_minimize(FUZZ_CASE*, FUZZ_RESULT*);
+int fuzz_report(FUZZ_CASE*, FUZZ_RESULT*);
+int fuzz_write_image(FUZZ_CASE*, char*);
+void fuzz_disassemble(uint32_t, uint32_t, char*);
+void console_open(CONSOLE*);
+void console_close(CONSOLE*);
+int worker(int, int, uint64_t, uint64_t, FUZZ_STATS*);
+void crash_handler(int);
+int fuzz_utoa(uint64_t, char*);
+
+int main(int argc, char** args) {
+    uint64_t n_cases = 100000, seed = 1;
+    int n_workers = sysconf(_SC_NPROCESSORS_ONLN), i;
+
+    // Options: -n cases, -j worker processes, -s first seed, -t translator period, -1 single-core only
+    while (argc > 1 && args[1][0] == '-') {
+        if (!strcmp(args[1], "-n") && argc > 2) {
+            n_cases = strtoull(args[2], NULL, 10);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-j") && argc > 2) {
+            n_workers = atoi(args[2]);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-s") && argc > 2) {
+            seed = strtoull(args[2], NULL, 10);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-t") && argc > 2) {
+            translate_every = atoi(args[2]);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-1")) {
+            multi_core = 0;
+            args++, argc--;
+        } else
+            break;
+    }
+    if (argc != 1 || n_workers < 1 || translate_every < 0) {
+        printf("Usage: %s [-n cases] [-j workers] [-s seed] [-t N] [-1]\n", args[0]);
+        printf("\t -n: number of programs to run (default 100000)\n");
+        printf("\t -j: worker processes (default: one per host CPU)\n");
+        printf("\t -s: seed of the first program, program k uses seed + k (default 1)\n");
+        printf("\t -t: also run every N-th halting program translated with %s (default 0: never)\n", FUZZ_TRANSLATOR);
+        printf("\t -1: single-core programs only\n");
+        exit(-1);
+    }
+#ifdef MACHINE
+    if (translate_every) {
+        printf("Error: %s models the generic machine, not machine %s\n", FUZZ_TRANSLATOR, MACHINE);
+        exit(-1);
+    }
+#endif
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // Worker w runs the cases w, w + n_workers, ... and sends its statistics back through a pipe
+    int fd[2];
+    pid_t pid;
+    if (pipe(fd) < 0) {
+        printf("Error: pipe()\n");
+        exit(-1);
+    }
+    for (i = 0; i < n_workers; i++) {
+        if ((pid = fork()) < 0) {
+            printf("Error: fork()\n");
+            exit(-1);
+        }
+        if (pid == 0) {
+            FUZZ_STATS st = {0};
+            close(fd[0]);
+            worker(i, n_workers, n_cases, seed, &st);
+            if (write(fd[1], &st, sizeof(st)) != sizeof(st))
+                _exit(-1);
+            _exit(st.failures ? 1 : 0);
+        }
+    }
+    close(fd[1]);
+
+    FUZZ_STATS total = {0}, st;
+    while (read(fd[0], &st, sizeof(st)) == sizeof(st)) {
+        total.cases += st.cases;
+        total.invalid += st.invalid;
+        total.halted += st.halted;
+        total.multi_core += st.multi_core;
+        total.parallel += st.parallel;
+        total.translated += st.translated;
+        total.failures += st.failures;
+        total.cycles += st.cycles;
+        total.interrupts += st.interrupts;
+    }
+    int status, crashed = 0;
+    while (wait(&status) > 0)
+        if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) > 1))
+            crashed++;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("\n--------FUZZING--------\n");
+    printf("Programs %llu (%llu multi-core, %llu of them also parallel, %llu halted, %llu translated, %llu rejected) "
+           "in %.2f s with %d workers\n",
+           (unsigned long long) total.cases, (unsigned long long) total.multi_core,
+           (unsigned long long) total.parallel, (unsigned long long) total.halted,
+           (unsigned long long) total.translated, (unsigned long long) total.invalid, secs, n_workers);
+    printf("Reference cycles %llu (%.0f per program), interrupts %llu\n", (unsigned long long) total.cycles,
+           total.cases ? (double) total.cycles / total.cases : 0.0, (unsigned long long) total.interrupts);
+    printf("%.0f programs/s, %.2f million per hour\n", total.cases / secs, total.cases / secs * 3600 / 1e6);
+    printf("Failures %llu, crashed workers %d\n", (unsigned long long) total.failures, crashed);
+    return (total.failures || crashed) ? 1 : 0;
+}
+
+/*
+xorshift64*, seeded per case so that every case can be regenerated from its seed
+*/
+uint64_t rng(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+int rng_range(int lo, int hi) {
+    return lo + (int) (rng() % (uint64_t) (hi - lo + 1));
+}
+
+uint32_t encode(uint8_t opcode, uint8_t sreg, uint8_t treg, int8_t imm) {
+    return (uint32_t) opcode << 24 | (uint32_t) sreg << 16 | (uint32_t) treg << 8 | (uint8_t) imm;
+}
+
+/*
+Memory layout of a generated program:
+
+    0                       ISR address
+    1 ...                   per core: FUZZ_STACK_SIZE words of stack, then
+                            FUZZ_LOOPS loop counters (sp starts between them)
+    data                    FUZZ_DATA_SIZE random words, one such area per
+                            core if the case has private data
+    code_start ...          set up sp and the base register, random body, halt
+    ...                     ISR: random straight-line code, iret
+    FUZZ_SCRATCH            unused
+
+The body is a list of instructions, push/pop groups and counted loops (up to
+three deep). A loop keeps its counter in memory at sp + its number and
+decrements it through R0, so even four registers leave room for random
+values. Branch targets are picked among the starts of those items after the
+branch, never inside a push/pop group, so the stack stays balanced and every
+program either halts or spins on a nop.
+*/
+void fuzz_generate(FUZZ_CASE* c, uint64_t seed) {
+    uint32_t* m = c->mem;
+    uint8_t target_ok[MAX_MEM_SIZE] = {0};
+    int fixup[MAX_MEM_SIZE], n_fixup = 0;
+    int loop_start[3], loop_end[3], loop_slot[3], depth = 0, n_loops = 0;
+    int i, pc, data, n_data, stack_top, isr_len, body_end;
+
+    memset(c, 0, sizeof(*c));
+    c->seed = seed;
+    rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+    if (multi_core && rng() % 4 == 0) {
+        c->private_data = rng() % 2;
+        c->n_cores = c->private_data ? rng_range(2, 3) : rng_range(2, 4);
+    } else
+        c->n_cores = 1;
+    c->quantum = rng_range(1, 200);
+    c->cycles = rng_range(FUZZ_MIN_CYCLES, FUZZ_MAX_CYCLES);
+
+    stack_top = 1 + FUZZ_STACK_SIZE;  // core 0, core i's is i * (FUZZ_STACK_SIZE + FUZZ_LOOPS) higher
+    data = 1 + c->n_cores * (FUZZ_STACK_SIZE + FUZZ_LOOPS);
+    n_data = (c->private_data ? c->n_cores : 1) * FUZZ_DATA_SIZE;
+    for (i = 0; i < n_data; i++)
+        m[data + i] = (rng() % 2) ? (uint32_t) rng_range(-8, 8) : (uint32_t) rng();
+    pc = c->code_start = c->entry = data + n_data;
+
+    // Prologue: sp = stack_top + R0 * (FUZZ_STACK_SIZE + FUZZ_LOOPS), base register = data
+    // (+ R0 * FUZZ_DATA_SIZE with private data), counting R0 down in R1 and summing in R2
+    if (c->n_cores == 1)
+        m[pc] = encode(OP_LA, 0, 64, stack_top - (pc + 1)), pc++;
+    else {
+        m[pc] = encode(OP_LA, 0, 2, stack_top - (pc + 1)), pc++;
+        if (c->private_data)
+            m[pc] = encode(OP_LA, 0, FUZZ_BASE, data - (pc + 1)), pc++;
+        m[pc++] = encode(OP_MOVEREG, 0, 1, 0);
+        m[pc++] = encode(OP_BLEZ, 1, 0, 3 + c->private_data);
+        m[pc++] = encode(OP_ADDI, 2, 2, FUZZ_STACK_SIZE + FUZZ_LOOPS);
+        if (c->private_data)
+            m[pc++] = encode(OP_ADDI, FUZZ_BASE, FUZZ_BASE, FUZZ_DATA_SIZE);
+        m[pc++] = encode(OP_ADDI, 1, 1, -1);
+        m[pc++] = encode(OP_JMP, 0, 0, -(4 + c->private_data));
+        m[pc++] = encode(OP_MOVEREG, 2, 64, 0);
+    }
+    if (!c->private_data)
+        m[pc] = encode(OP_LA, 0, FUZZ_BASE, data - (pc + 1)), pc++;
+
+    isr_len = rng_range(1, 6);
+    body_end = FUZZ_SCRATCH - isr_len - 1 - 3 * 5;  // room for closing three loops, halt and the ISR
+    body_end = pc + rng_range(1, body_end - pc);
+
+    while (pc < body_end || depth > 0) {
+        int r = rng() % 100, reg = rng_range(0, FUZZ_REGS - 1), reg2 = rng_range(0, FUZZ_REGS - 1);
+        target_ok[pc] = 1;
+        if (depth > 0 && (pc >= body_end || pc >= loop_end[depth - 1] || r < 5)) {
+            // close the innermost loop: decrement the counter, exit when <= 0, jump back. Branches
+            // may only land on the load of the counter, or a loop could go round without it
+            int k = loop_slot[--depth];
+            m[pc++] = encode(OP_LW, 64, 0, k);
+            m[pc++] = encode(OP_ADDI, 0, 0, -1);
+            m[pc++] = encode(OP_SW, 64, 0, k);
+            m[pc++] = encode(OP_BLEZ, 0, 0, 1);
+            m[pc] = encode(OP_JMP, 0, 0, loop_start[depth] - (pc + 1)), pc++;
+            continue;
+        }
+        if (r < 14 && depth < 3 && pc + 8 < body_end && n_loops < FUZZ_LOOPS) {
+            int k = loop_slot[depth] = n_loops++;
+            m[pc++] = encode(OP_MOVEI, 0, 0, rng_range(1, 60));
+            m[pc++] = encode(OP_SW, 64, 0, k);
+            loop_start[depth] = pc;
+            loop_end[depth] = pc + rng_range(2, body_end - pc - 3);
+            depth++;
+        } else if (r < 20) {
+            m[pc] = encode(OP_BLEZ, reg, 0, 0);
+            fixup[n_fixup++] = pc++;
+        } else if (r < 22) {
+            m[pc] = encode(OP_JMP, 0, 0, 0);
+            fixup[n_fixup++] = pc++;
+        } else if (r < 28 && pc + 3 < body_end) {
+            // push/pop group: no branch may land inside it
+            m[pc++] = encode(OP_PUSH, reg, 0, 0);
+            if (rng() % 2)
+                m[pc++] = encode(OP_ADDI, reg2, reg2, rng_range(-3, 3));
+            m[pc++] = encode(OP_POP, 0, rng_range(0, FUZZ_REGS - 1), 0);
+        } else if (r < 36)
+            m[pc++] = encode(OP_LW, FUZZ_BASE, reg, rng_range(0, FUZZ_DATA_SIZE - 1));
+        else if (r < 42)
+            m[pc++] = encode(OP_SW, FUZZ_BASE, reg, rng_range(0, FUZZ_DATA_SIZE - 1));
+        else if (r < 46)
+            m[pc++] = encode(OP_XCHG, FUZZ_BASE, reg, rng_range(0, FUZZ_DATA_SIZE - 1));
+        else if (r < 58)
+            m[pc++] = encode(OP_ADDI, reg2, reg, rng_range(-128, 127));
+        else if (r < 66)
+            m[pc++] = encode(OP_MOVEI, 0, reg, rng_range(-128, 127));
+        else if (r < 74)
+            m[pc++] = encode(OP_ADD, (rng() % 8) ? reg2 : 64, reg, 0);
+        else if (r < 80)
+            m[pc++] = encode(OP_MOVEREG, (rng() % 8) ? reg2 : 64, reg, 0);
+        else if (r < 84)
+            m[pc] = encode(OP_LA, 0, reg, rng_range(c->code_start, body_end) - (pc + 1)), pc++;
+        else if (r < 92)
+            m[pc++] = encode(OP_PUT, reg, 0, 0);
+        else if (r < 93 && pc + 2 < body_end) {
+            // an access to the device window, which has no devices here: reads return 0, writes are ignored
+            static const uint8_t op[] = {OP_LW, OP_SW, OP_XCHG};
+            m[pc++] = encode(OP_MOVEI, 0, reg, 0);
+            m[pc++] = encode(op[rng() % 3], reg, reg2, rng_range(-128, -1));
+        }
+        else if (r < 94 && rng() % 16 == 0)
+            m[pc++] = encode(OP_NOP, 0, 0, 0);  // spins until the next interrupt, forever
+        else
+            m[pc++] = encode(OP_ADDI, reg, reg, 1);
+    }
+    target_ok[pc] = 1;
+    m[pc++] = encode(OP_HALT, 0, 0, 0);
+    c->code_end = pc;
+
+    // Forward branches
+    for (i = 0; i < n_fixup; i++) {
+        int t;
+        do
+            t = rng_range(fixup[i] + 1, c->code_end - 1);
+        while (!target_ok[t]);
+        m[fixup[i]] = (m[fixup[i]] & 0xffffff00) | (uint8_t) (t - fixup[i] - 1);
+    }
+
+    // ISR: a few register updates (maybe saved around them on the stack), then iret. It leaves
+    // R0 alone, which holds a loop counter between its load and the branch
+    m[0] = pc;
+    for (i = 0; i < isr_len - 1; i++) {
+        int reg = rng_range(1, FUZZ_REGS - 1);
+        m[pc++] = (rng() % 2) ? encode(OP_ADDI, reg, reg, rng_range(-4, 4)) : encode(OP_PUT, reg, 0, 0);
+    }
+    m[pc++] = encode(OP_IRET, 0, 0, 0);
+    c->code_end = pc;
+}
+
+/*
+One cycle of the reference engine: the simulator's own pipeline functions,
+called one at a time. Interrupts are logged into 't' for the replay engine.
+Returns -1 on halt and -2 if the instruction (or the interrupt entry) would
+touch memory outside the machine or write over the program.
+*/
+int fuzz_step(COMPUTER* cp, FUZZ_CASE* c, TRACE* t) {
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    int64_t rd = -1, rd2 = -1, wr = -1;
+    int i;
+    CPU* p = &cp->cpu;
+
+    if (p->PC >= MAX_MEM_SIZE || decode(cp->memory->addr[p->PC], &opcode, &sreg, &treg, &imm) < 0)
+        return -1;
+    switch (opcode) {
+    case OP_LW:
+        rd = (int64_t) p->R[sreg] + imm;
+        break;
+    case OP_SW:
+    case OP_XCHG:
+        wr = (int64_t) p->R[sreg] + imm;
+        break;
+    case OP_PUSH:
+        wr = (int64_t) p->SP - 1;
+        break;
+    case OP_POP:
+        rd = p->SP;
+        break;
+    case OP_IRET:
+        rd = p->SP;
+        rd2 = (int64_t) p->SP + 1;
+        break;
+    }
+    if ((rd != -1 && !IS_IO(rd) && (rd < 0 || rd >= MAX_MEM_SIZE)) ||
+        (rd2 != -1 && (rd2 < 0 || rd2 >= MAX_MEM_SIZE)))
+        return -2;
+    if (wr != -1 && !IS_IO(wr) && (wr < 0 || wr >= MAX_MEM_SIZE || (wr >= c->code_start && wr < c->code_end)))
+        return -2;
+    // Counted as the debugger does, where xchg both reads and writes its word
+    for (i = 0; i < 2; i++)
+        ref_watch_hits[i] += (rd == ref_watch[i]) + (rd2 == ref_watch[i]) +
+                             (wr == ref_watch[i]) * (opcode == OP_XCHG ? 2 : 1);
+
+    if (fetch(cp) < 0 || decode(p->IR, &opcode, &sreg, &treg, &imm) < 0 ||
+        execute(cp, &opcode, &sreg, &treg, &imm) < 0)
+        return -1;
+    timer_tick(cp);
+    if (p->PSR & PSR_INT_EN && p->PSR & PSR_INT_PEND) {
+        int64_t sp = p->SP;
+        if (sp < 2 || sp > MAX_MEM_SIZE || (sp - 2 < c->code_end && sp > c->code_start))
+            return -2;
+        for (i = 0; i < 2; i++)
+            ref_watch_hits[i] += (sp - 1 == ref_watch[i]) + (sp - 2 == ref_watch[i]) + (ref_watch[i] == 0);
+        if (t != NULL) {
+            if (t->n_ev % 64 == 0)
+                t->ev = realloc(t->ev, (t->n_ev + 64) * sizeof(TRACE_EVENT));
+            t->ev[t->n_ev].counter = p->counter;
+            t->ev[t->n_ev].vector = cp->memory->addr[0];
+            t->ev[t->n_ev].psr = p->PSR;
+            t->n_ev++;
+        }
+    }
+    check_interrupt(cp);
+    return 0;
+}
+
+/*
+Run one case on the reference and on every engine. Returns 1 if an engine
+disagreed (details in 'res'), -1 if the case is invalid, 0 otherwise.
+*/
+int fuzz_check(FUZZ_CASE* c, int translate, FUZZ_RESULT* res) {
+    memset(res, 0, sizeof(*res));
+    res->engine = -1;
+    res->translated = translate;
+    return (c->n_cores == 1) ? fuzz_check_single(c, res) : fuzz_check_multi(c, res);
+}
+
+int fuzz_check_single(FUZZ_CASE* c, FUZZ_RESULT* res) {
+    static MEMORY memory[ENGINE_REPLAY + 1];
+    static COMPUTER comp[ENGINE_REPLAY + 1];
+    static DEBUGGER debugger;
+    static uint8_t coverage[2][MAX_MEM_SIZE];  // of the normal and the instrumented loop, must agree
+    static TRACE trace;
+    static int cap_ck = 0;
+    CONSOLE out[ENGINE_REPLAY + 2];  // the reference's first
+    COMPUTER ref;
+    MEMORY ref_memory;
+    int i, e, ret = 0, halted = 0, chunk;
+    uint64_t exec_hits = 0;  // times the reference reached a breakpoint
+
+    memset(&ref, 0, sizeof(ref));
+    memcpy(ref_memory.addr, c->mem, sizeof(ref_memory.addr));
+    ref.memory = &ref_memory;
+    cpu_init(&ref, 0, c->entry);
+    console_open(&out[0]);
+    ref.console = out[0].fp;
+    for (e = ENGINE_RUN; e <= ENGINE_REPLAY; e++) {
+        COMPUTER* cp = &comp[e];
+        memset(cp, 0, sizeof(*cp));
+        memcpy(memory[e].addr, c->mem, sizeof(memory[e].addr));
+        cp->memory = &memory[e];
+        cpu_init(cp, 0, c->entry);
+        console_open(&out[e + 1]);
+        cp->console = out[e + 1].fp;
+    }
+    memset(coverage, 0, sizeof(coverage));
+    comp[ENGINE_RUN].coverage = coverage[0];
+    comp[ENGINE_INSTRUMENTED].debugger = &debugger;
+    comp[ENGINE_INSTRUMENTED].coverage = coverage[1];
+    comp[ENGINE_REPLAY].trace = &trace;
+    comp[ENGINE_REPLAY].quiet = 1;
+    trace.n_ck = trace.n_ev = 0;
+
+    // The chunk lengths and the watches come from the seed too, so a minimized case sees the same
+    // comparisons. sp is never negative, so no watch stops the run, but every one counts its hits
+    uint64_t saved_rng = rng_state;
+    rng_state = c->seed * 0xbf58476d1ce4e5b9ull + 7;
+    memset(&debugger, 0, sizeof(debugger));
+    debug_watch(&debugger, WATCH_EXEC, rng_range(c->code_start, c->code_end - 1), 64, '<', 0);
+    debug_watch(&debugger, WATCH_EXEC, rng_range(c->code_start, c->code_end - 1), 64, '<', 0);
+    debug_watch(&debugger, WATCH_READ | WATCH_WRITE, rng_range(c->code_start - FUZZ_DATA_SIZE, c->code_start - 1),
+                64, '<', 0);
+    debug_watch(&debugger, WATCH_READ | WATCH_WRITE, FUZZ_STACK_SIZE, 64, '<', 0);  // top word of the stack
+    for (i = 0; i < 2; i++) {
+        ref_watch[i] = debugger.watch[2 + i].addr;
+        ref_watch_hits[i] = 0;
+    }
+    for (chunk = 0; !halted && ref.cpu.counter < c->cycles && ret == 0; chunk++) {
+        if (chunk % FUZZ_CK_INTERVAL == 0) {
+            if (trace.n_ck == cap_ck)
+                trace.ck = realloc(trace.ck, (cap_ck = cap_ck * 2 + 16) * sizeof(CHECKPOINT));
+            trace.ck[trace.n_ck].cpu = ref.cpu;
+            trace.ck[trace.n_ck].memory = ref_memory;
+            trace.n_ck++;
+        }
+        uint64_t n = rng_range(1, FUZZ_MAX_CHUNK), left = c->cycles - ref.cpu.counter;
+        if (n > left)
+            n = left;
+        for (i = 0; i < n; i++) {
+            exec_hits += (ref.cpu.PC == debugger.watch[0].addr) + (ref.cpu.PC == debugger.watch[1].addr);
+            int r = fuzz_step(&ref, c, &trace);
+            if (r == -2) {
+                ret = -1;
+                break;
+            }
+            if (r == -1) {
+                halted = 1;
+                break;
+            }
+        }
+        if (ret < 0)
+            break;
+        res->counter = ref.cpu.counter;
+
+        for (e = ENGINE_RUN; e <= ENGINE_INSTRUMENTED && ret == 0; e++) {
+            int r = computer_run(&comp[e], n);
+            if ((r < 0) != halted) {
+                res->engine = e;
+                snprintf(res->why, sizeof(res->why), "%s after %llu cycles (reference %s)",
+                         r < 0 ? "halted" : "still running", (unsigned long long) comp[e].cpu.counter,
+                         halted ? "halted" : "still running");
+                ret = 1;
+            } else if (fuzz_compare(&ref, &comp[e], &out[0], &out[e + 1], 1, res)) {
+                res->engine = e;
+                ret = 1;
+            }
+        }
+        if (ret == 0 && (chunk % 4 == 3 || halted)) {
+            COMPUTER* rp = &comp[ENGINE_REPLAY];
+            if (replay_seek(rp, ref.cpu.counter) < 0) {
+                res->engine = ENGINE_REPLAY;
+                snprintf(res->why, sizeof(res->why), "halted at %llu seeking to %llu",
+                         (unsigned long long) rp->cpu.counter, (unsigned long long) ref.cpu.counter);
+                ret = 1;
+            } else if (fuzz_compare(&ref, rp, NULL, NULL, 1, res)) {
+                res->engine = ENGINE_REPLAY;
+                ret = 1;
+            }
+        }
+    }
+    if (ret == 0 && debugger.watch[0].hits + debugger.watch[1].hits != exec_hits) {
+        res->engine = ENGINE_INSTRUMENTED;
+        snprintf(res->why, sizeof(res->why), "breakpoints hit %llu times, reference %llu",
+                 (unsigned long long) (debugger.watch[0].hits + debugger.watch[1].hits),
+                 (unsigned long long) exec_hits);
+        ret = 1;
+    }
+    for (i = 0; ret == 0 && i < 2; i++) {
+        if (debugger.watch[2 + i].hits != ref_watch_hits[i]) {
+            res->engine = ENGINE_INSTRUMENTED;
+            snprintf(res->why, sizeof(res->why), "watch on word %u hit %llu times, reference %llu",
+                     debugger.watch[2 + i].addr, (unsigned long long) debugger.watch[2 + i].hits,
+                     (unsigned long long) ref_watch_hits[i]);
+            ret = 1;
+        }
+    }
+    ref_watch[0] = ref_watch[1] = -1;
+    for (i = 0; ret == 0 && i < MAX_MEM_SIZE; i++) {
+        if (coverage[0][i] != coverage[1][i]) {
+            res->engine = ENGINE_RUN;
+            snprintf(res->why, sizeof(res->why), "coverage of word %d is 0x%x, instrumented loop 0x%x", i,
+                     coverage[0][i], coverage[1][i]);
+            ret = 1;
+        }
+    }
+    rng_state = saved_rng;
+    res->cycles = ref.cpu.counter;
+    res->interrupts = trace.n_ev;
+    res->halted = halted;
+    res->invalid = (ret < 0);
+
+    if (ret == 0 && halted && res->translated)
+        ret = fuzz_check_translator(c, &ref, &out[0], res);
+    for (e = 0; e < ENGINE_REPLAY + 2; e++)
+        console_close(&out[e]);
+    return ret;
+}
+
+/*
+Multi-core cases: the reference schedules the cores itself with the same
+quantum, then the whole run is compared with run_round_robin(). Cases with
+private data are also run with run_parallel(), where only the order of the
+console output may differ.
+*/
+int fuzz_check_multi(FUZZ_CASE* c, FUZZ_RESULT* res) {
+    static MEMORY memory[3];
+    static COMPUTER core[3][MAX_CORES];
+    CONSOLE out[3];
+    uint8_t halted[MAX_CORES] = {0};
+    int i, g, running = c->n_cores, ret = 0;
+
+    for (g = 0; g < 3; g++) {
+        memcpy(memory[g].addr, c->mem, sizeof(memory[g].addr));
+        console_open(&out[g]);
+        for (i = 0; i < c->n_cores; i++) {
+            memset(&core[g][i], 0, sizeof(COMPUTER));
+            core[g][i].memory = &memory[g];
+            core[g][i].console = out[g].fp;
+            cpu_init(&core[g][i], i, c->entry);
+        }
+    }
+
+    while (running > 0 && ret == 0) {
+        for (i = 0; i < c->n_cores && ret == 0; i++) {
+            uint64_t left = c->cycles - core[0][i].cpu.counter, k;
+            if (halted[i])
+                continue;
+            if (left == 0) {
+                halted[i] = 1;
+                running--;
+                continue;
+            }
+            for (k = 0; k < c->quantum && k < left; k++) {
+                int r = fuzz_step(&core[0][i], c, NULL);
+                if (r == -2)
+                    ret = -1;
+                if (r < 0) {
+                    halted[i] = (r == -1);
+                    running -= (r == -1);
+                    break;
+                }
+            }
+        }
+    }
+    res->invalid = (ret < 0);
+    if (ret == 0) {
+        res->halted = 1;
+        for (i = 0; i < c->n_cores; i++) {
+            res->halted &= core[0][i].cpu.counter < c->cycles;
+            res->cycles += core[0][i].cpu.counter;
+        }
+        max_cycles = c->cycles;
+        run_round_robin(core[1], c->n_cores, c->quantum);
+        if (c->private_data)
+            run_parallel(core[2], c->n_cores);
+        for (g = 1; g < 3 && ret == 0; g++) {
+            for (i = 0; i < c->n_cores && ret == 0 && (g == 1 || c->private_data); i++) {
+                res->counter = core[0][i].cpu.counter;
+                // in parallel the cores write to the console in any order, that is compared below
+                if (fuzz_compare(&core[0][i], &core[g][i], g == 1 ? &out[0] : NULL, g == 1 ? &out[1] : NULL,
+                                 i == 0, res)) {
+                    char why[sizeof(res->why)];
+                    memcpy(why, res->why, sizeof(why));
+                    snprintf(res->why, sizeof(res->why), "core %d: %.140s", i, why);
+                    res->engine = (g == 1) ? ENGINE_ROUND_ROBIN : ENGINE_PARALLEL;
+                    ret = 1;
+                }
+            }
+        }
+        if (ret == 0 && c->private_data) {
+            size_t count[2][256] = {{0}}, k;
+            fflush(out[0].fp);
+            fflush(out[2].fp);
+            for (k = 0; k < out[0].size; k++)
+                count[0][(uint8_t) out[0].buf[k]]++;
+            for (k = 0; k < out[2].size; k++)
+                count[1][(uint8_t) out[2].buf[k]]++;
+            for (i = 0; i < 256 && ret == 0; i++)
+                if (count[0][i] != count[1][i]) {
+                    res->engine = ENGINE_PARALLEL;
+                    snprintf(res->why, sizeof(res->why), "console output has byte 0x%02x %zu times, reference %zu", i,
+                             count[1][i], count[0][i]);
+                    ret = 1;
+                }
+        }
+    }
+    for (g = 0; g < 3; g++)
+        console_close(&out[g]);
+    return ret;
+}
+
+/*
+Translate the case with itrans -d, compile and run it, and compare its console
+output and final state with the reference's.
+*/
+int fuzz_check_translator(FUZZ_CASE* c, COMPUTER* ref, CONSOLE* ref_out, FUZZ_RESULT* res) {
+    char image[96], cmd[1024], file[96];
+    const char* cc = getenv("CC") ? getenv("CC") : "cc";
+    int ret = 0;
+
+    snprintf(image, sizeof(image), "%s/case.code", work_dir);
+    fuzz_write_image(c, image);
+    snprintf(cmd, sizeof(cmd),
+             "%s -d %s %s/case.c > /dev/null && %s -O0 -w -o %s/case %s/case.c && "
+             "timeout 10 %s/case > %s/out 2> %s/state",
+             FUZZ_TRANSLATOR, image, work_dir, cc, work_dir, work_dir, work_dir, work_dir, work_dir);
+    res->engine = ENGINE_TRANSLATOR;
+    if (system(cmd) != 0) {
+        snprintf(res->why, sizeof(res->why), "translating, compiling or running the program failed");
+        return 1;
+    }
+
+    // stdout: the banner (4 lines) then the console output
+    snprintf(file, sizeof(file), "%s/out", work_dir);
+    FILE* fp = fopen(file, "rb");
+    char* buf = calloc(1, ref_out->size + 2);
+    int ch, lines = 0;
+    while (lines < 4 && (ch = fgetc(fp)) != EOF)
+        lines += (ch == '\n');
+    size_t n = fread(buf, 1, ref_out->size + 1, fp);
+    fclose(fp);
+    if (n != ref_out->size || memcmp(buf, ref_out->buf, n)) {
+        snprintf(res->why, sizeof(res->why), "console output differs (%zu bytes, reference %zu)", n, ref_out->size);
+        ret = 1;
+    }
+    free(buf);
+
+    // stderr: the state dump, in the format of fuzz_state()
+    CONSOLE want;
+    console_open(&want);
+    fuzz_state(ref, want.fp);
+    fflush(want.fp);
+    snprintf(file, sizeof(file), "%s/state", work_dir);
+    fp = fopen(file, "rb");
+    buf = calloc(1, want.size + 2);
+    n = fread(buf, 1, want.size + 1, fp);
+    fclose(fp);
+    if (ret == 0 && (n != want.size || memcmp(buf, want.buf, n))) {
+        size_t k = 0;
+        while (k < n && k < want.size && buf[k] == want.buf[k])
+            k++;
+        while (k > 0 && want.buf[k - 1] != '\n')
+            k--;
+        size_t len = 0;
+        while (k + len < n && buf[k + len] != '\n')
+            len++;
+        snprintf(res->why, sizeof(res->why), "final state differs at \"%.*s\"", (int) len, buf + k);
+        ret = 1;
+    }
+    free(buf);
+    console_close(&want);
+    if (ret == 0)
+        res->engine = -1;
+    return ret;
+}
+
+/*
+Compare the architectural state of an engine with the reference's (IR is an
+internal register of the pipeline and not compared). Returns 1 and describes
+the first difference if they disagree.
+*/
+int fuzz_compare(COMPUTER* ref, COMPUTER* cp, CONSOLE* ref_out, CONSOLE* out, int memory, FUZZ_RESULT* res) {
+    CPU *a = &ref->cpu, *b = &cp->cpu;
+    int i;
+
+    if (a->PC != b->PC || a->PSR != b->PSR || a->counter != b->counter) {
+        snprintf(res->why, sizeof(res->why), "PC %u PSR 0x%x counter %llu, reference PC %u PSR 0x%x counter %llu",
+                 b->PC, b->PSR, (unsigned long long) b->counter, a->PC, a->PSR, (unsigned long long) a->counter);
+        return 1;
+    }
+    for (i = 0; i < N_REG_SLOTS; i++)
+        if (a->R[i] != b->R[i]) {
+            char name[8];
+            snprintf(name, sizeof(name), i == SP_SLOT ? "sp" : "R%d", i);
+            snprintf(res->why, sizeof(res->why), "%s = %d, reference %d", name, b->R[i], a->R[i]);
+            return 1;
+        }
+    for (i = 0; memory && i < MAX_MEM_SIZE; i++)
+        if (ref->memory->addr[i] != cp->memory->addr[i]) {
+            snprintf(res->why, sizeof(res->why), "mem[%d] = 0x%x, reference 0x%x", i, cp->memory->addr[i],
+                     ref->memory->addr[i]);
+            return 1;
+        }
+    if (ref_out != NULL) {
+        fflush(ref_out->fp);
+        fflush(out->fp);
+        if (ref_out->size != out->size || memcmp(ref_out->buf, out->buf, out->size)) {
+            snprintf(res->why, sizeof(res->why), "console output differs (%zu bytes, reference %zu)", out->size,
+                     ref_out->size);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+The state dump of itrans -d, which always lists R0-R64 (R64 is sp)
+*/
+int fuzz_state(COMPUTER* cp, FILE* fp) {
+    int i;
+    fprintf(fp, "PC %u PSR 0x%x counter %llu\n", cp->cpu.PC, cp->cpu.PSR, (unsigned long long) cp->cpu.counter);
+    for (i = 0; i < 65; i++)
+        fprintf(fp, "R%d %d\n", i, REG_VALID(i) ? cp->cpu.R[REG(i)] : 0);
+    for (i = 0; i < MAX_MEM_SIZE; i++)
+        fprintf(fp, "M%d 0x%08x\n", i, cp->memory->addr[i]);
+    return 0;
+}
+
+/*
+Shrink a failing case: first the cycle limit to where the difference was
+seen, then replace instructions with halt (from the last one backwards) and
+zero data words, as long as the same engine still fails. Returns the number
+of words removed.
+*/
+int fuzz_minimize(FUZZ_CASE* c, FUZZ_RESULT* res) {
+    FUZZ_RESULT r;
+    FUZZ_CASE best = *c;
+    int engine = res->engine, removed = 0, changed = 1, i;
+
+    best.cycles = res->counter ? res->counter : 1;
+    if (fuzz_check(&best, res->translated, &r) == 1 && r.engine == engine)
+        *c = best, *res = r;
+    best = *c;
+
+    while (changed) {
+        changed = 0;
+        for (i = MAX_MEM_SIZE - 1; i > 0; i--) {
+            if (best.mem[i] == 0 || i == best.entry)
+                continue;
+            uint32_t saved = best.mem[i];
+            best.mem[i] = 0;
+            if (fuzz_check(&best, res->translated, &r) == 1 && r.engine == engine) {
+                *c = best, *res = r;
+                removed++;
+                changed = 1;
+            } else
+                best.mem[i] = saved;
+        }
+    }
+    return removed;
+}
+
+int fuzz_report(FUZZ_CASE* c, FUZZ_RESULT* res) {
+    char file[64], text[64];
+    uint32_t i;
+
+    snprintf(file, sizeof(file), "fuzz-%llu.code", (unsigned long long) c->seed);
+    fuzz_write_image(c, file);
+    printf("\n--------MISMATCH (seed %llu)--------\n", (unsigned long long) c->seed);
+    printf("Engine %s, reference cycle %llu: %s\n", engine_name[res->engine], (unsigned long long) res->counter,
+           res->why);
+    printf("Minimized program written to %s, run it with ./" FUZZ_ICPU " -n %llu", file,
+           (unsigned long long) c->cycles);
+    if (res->engine == ENGINE_PARALLEL)
+        printf(" -c %d -p", c->n_cores);
+    else if (c->n_cores > 1)
+        printf(" -c %d -q %llu", c->n_cores, (unsigned long long) c->quantum);
+    printf(" %s\n", file);
+    printf("Regenerate the original with ./" FUZZ_NAME " -n 1 -j 1 -s %llu%s\n", (unsigned long long) c->seed,
+           res->translated ? " -t 1" : "");
+    for (i = 0; i < MAX_MEM_SIZE; i++) {
+        if (c->mem[i] == 0)
+            continue;
+        if (i >= c->code_start && i < c->code_end)
+            fuzz_disassemble(i, c->mem[i], text);
+        else
+            snprintf(text, sizeof(text), ".word %d", c->mem[i]);
+        printf("%4u: %s%s\n", i, text, i == c->entry ? "    ; entry" : "");
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*
+Write the whole memory as one section of a versioned image
+*/
+int fuzz_write_image(FUZZ_CASE* c, char* file) {
+    struct {
+        IMAGE_SECTION sec;
+        uint32_t mem[MAX_MEM_SIZE];
+    } body;
+    IMAGE_HEADER h = {IMAGE_MAGIC, IMAGE_VERSION, c->entry, 1, 0};
+
+    body.sec.type = SECTION_CODE;
+    body.sec.addr = 0;
+    body.sec.offset = sizeof(h) + sizeof(body.sec);
+    body.sec.size = sizeof(body.mem);
+    memcpy(body.mem, c->mem, sizeof(body.mem));
+    h.checksum = image_checksum((uint8_t*) &body, sizeof(body));
+
+    FILE* fp = fopen(file, "wb");
+    if (fp == NULL) {
+        printf("Error: cannot open %s\n", file);
+        return -1;
+    }
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(&body, sizeof(body), 1, fp);
+    fclose(fp);
+    return 0;
+}
+
+/*
+Assembler syntax, with branch targets as absolute addresses. The fields are
+taken apart here, not by decode(), which maps registers to their slots.
+*/
+void fuzz_disassemble(uint32_t addr, uint32_t instr, char* text) {
+    uint8_t opcode = instr >> 24, sreg = instr >> 16, treg = instr >> 8;
+    int8_t imm = (int8_t) instr;
+    char rs[8], rt[8];
+
+    snprintf(rs, sizeof(rs), sreg == 64 ? "sp" : "R%d", sreg);
+    snprintf(rt, sizeof(rt), treg == 64 ? "sp" : "R%d", treg);
+    switch (opcode) {
+    case OP_HALT:
+        sprintf(text, "halt");
+        break;
+    case OP_NOP:
+        sprintf(text, "NOP");
+        break;
+    case OP_ADDI:
+        sprintf(text, "addi %s, %s, %d", rs, rt, imm);
+        break;
+    case OP_MOVEREG:
+        sprintf(text, "move_reg %s, %s", rs, rt);
+        break;
+    case OP_MOVEI:
+        sprintf(text, "movei %s, %d", rt, imm);
+        break;
+    case OP_LW:
+        sprintf(text, "lw %s, %s, %d", rs, rt, imm);
+        break;
+    case OP_SW:
+        sprintf(text, "sw %s, %s, %d", rs, rt, imm);
+        break;
+    case OP_XCHG:
+        sprintf(text, "xchg %s, %s, %d", rs, rt, imm);
+        break;
+    case OP_BLEZ:
+        sprintf(text, "blez %s, %d", rs, addr + 1 + imm);
+        break;
+    case OP_LA:
+        sprintf(text, "la %s, %d", rt, addr + 1 + imm);
+        break;
+    case OP_PUSH:
+        sprintf(text, "push %s", rs);
+        break;
+    case OP_POP:
+        sprintf(text, "pop %s", rt);
+        break;
+    case OP_ADD:
+        sprintf(text, "add %s, %s", rs, rt);
+        break;
+    case OP_JMP:
+        sprintf(text, "jmp %d", addr + 1 + imm);
+        break;
+    case OP_IRET:
+        sprintf(text, "iret");
+        break;
+    case OP_PUT:
+        sprintf(text, "put %s", rs);
+        break;
+    default:
+        sprintf(text, ".word %d", instr);
+    }
+}
+
+void console_open(CONSOLE* out) {
+    out->buf = NULL;
+    out->size = 0;
+    out->fp = open_memstream(&out->buf, &out->size);
+}
+
+void console_close(CONSOLE* out) {
+    fclose(out->fp);
+    free(out->buf);
+}
+
+/*
+Run the cases w, w + n_workers, ... below n_cases. Stops at the first
+mismatch, which is minimized and reported.
+*/
+int worker(int w, int n_workers, uint64_t n_cases, uint64_t seed, FUZZ_STATS* st) {
+    FUZZ_CASE c;
+    FUZZ_RESULT res;
+    uint64_t k;
+
+    snprintf(work_dir, sizeof(work_dir), "/tmp/ifuzz.XXXXXX");
+    if (translate_every && mkdtemp(work_dir) == NULL) {
+        printf("Error: mkdtemp()\n");
+        exit(-1);
+    }
+    signal(SIGSEGV, crash_handler);
+    signal(SIGBUS, crash_handler);
+
+    for (k = w; k < n_cases; k += n_workers) {
+        current_seed = seed + k;
+        fuzz_generate(&c, seed + k);
+        // Only programs that halt are translated, so this is an upper bound
+        int translate = translate_every && c.n_cores == 1 && (k / n_workers) % translate_every == 0;
+        int ret = fuzz_check(&c, translate, &res);
+
+        st->cases++;
+        st->multi_core += (c.n_cores > 1);
+        st->parallel += c.private_data;
+        st->invalid += res.invalid;
+        st->halted += res.halted;
+        st->cycles += res.cycles;
+        st->interrupts += res.interrupts;
+        st->translated += translate && res.halted && !res.invalid;
+        if (ret > 0) {
+            st->failures++;
+            fuzz_minimize(&c, &res);
+            fuzz_report(&c, &res);
+            break;
+        }
+    }
+    if (translate_every) {
+        char cmd[96];
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", work_dir);
+        if (system(cmd) != 0)
+            printf("Warning: cannot remove %s\n", work_dir);
+    }
+    return 0;
+}
+
+/*
+Runs in the signal handler, so the message is put together without stdio
+*/
+void crash_handler(int sig) {
+    char sig_text[24], seed_text[24];
+    const char* part[] = {"\nWorker crashed (signal ", sig_text, ") on seed ", seed_text,
+                          ", regenerate it with ./" FUZZ_NAME " -n 1 -j 1 -s ", seed_text, "\n"};
+    int i;
+
+    fuzz_utoa(sig, sig_text);
+    fuzz_utoa(current_seed, seed_text);
+    for (i = 0; i < sizeof(part) / sizeof(part[0]); i++)
+        if (write(STDOUT_FILENO, part[i], strlen(part[i])) < 0)
+            break;
+    _exit(2);
+}
+
+/*
+Decimal digits of 'v' into 'text', returns their number
+*/
+int fuzz_utoa(uint64_t v, char* text) {
+    char digits[24];
+    int n = 0, i;
+
+    do
+        digits[n++] = '0' + v % 10;
+    while (v /= 10);
+    for (i = 0; i < n; i++)
+        text[i] = digits[n - 1 - i];
+    text[n] = 0;
+    return n;
+}
@@ -0,0 +1,141 @@
+/*
+Executable image format shared by the assembler, the simulator and the
+translator. All fields are little-endian 32-bit words, matching the memory
+layout of the simulated machine.
+
+    IMAGE_HEADER                      magic, version, entry point, checksum
+    IMAGE_SECTION[n_sections]         section table
+    section contents                  word aligned, in section table order
+
+The checksum covers everything after the header. Images without the magic
+number are legacy headerless dumps and are loaded at address 0 as before.
+*/
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC 0x41534958  // "XISA" in file byte order
+#define IMAGE_VERSION 1
+#define IMAGE_SYMBOL_LENGTH 32  // bytes reserved for a symbol name, including '\0'
+
+enum {
+    SECTION_CODE = 1,
+    SECTION_DATA = 2,
+    SECTION_SYMBOL = 3,  // IMAGE_SYMBOL records, not loaded into memory
+};
+
+typedef struct image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry;       // initial PC
+    uint32_t n_sections;  // entries in the section table
+    uint32_t checksum;    // image_checksum() of the bytes after the header
+} IMAGE_HEADER;
+
+typedef struct image_section {
+    uint32_t type;
+    uint32_t addr;    // load address (unit: word), unused for symbols
+    uint32_t offset;  // file offset of the contents (unit: byte)
+    uint32_t size;    // size of the contents (unit: byte)
+} IMAGE_SECTION;
+
+typedef struct image_symbol {
+    uint32_t addr;
+    char name[IMAGE_SYMBOL_LENGTH];
+} IMAGE_SYMBOL;
+
+/*
+32-bit FNV-1a hash
+*/
+static inline uint32_t image_checksum(const uint8_t* p, size_t len) {
+    uint32_t h = 2166136261u;
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+Map the image file and copy its loadable sections into 'mem' (mem_size words,
+zero filled first). The file is mapped read-only and shared, so any number of
+simulators loading the same image share its page cache pages; only the guest
+memory itself is private. '*p_entry' is set from the header, or left untouched
+for a legacy image. Returns 1 for a versioned image, 0 for a legacy one and -1
+on error (after printing the reason).
+*/
+static inline int image_load(const char* file, uint32_t* mem, int mem_size, uint32_t* p_entry) {
+    int fd;
+    struct stat st;
+    uint8_t* base;
+    size_t size;
+
+    if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        printf("Error: open().\n");
+        return -1;
+    }
+    memset(mem, 0, mem_size * 4);
+    size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Error: mmap().\n");
+        return -1;
+    }
+
+    const IMAGE_HEADER* h = (const IMAGE_HEADER*) base;
+    if (size < sizeof(IMAGE_HEADER) || h->magic != IMAGE_MAGIC) {
+        // Legacy headerless image: a dump of memory starting at address 0
+        memcpy(mem, base, size < (size_t) mem_size * 4 ? size : (size_t) mem_size * 4);
+        munmap(base, size);
+        return 0;
+    }
+
+    int ret = 1;
+    const IMAGE_SECTION* sec = (const IMAGE_SECTION*) (h + 1);
+    if (h->version != IMAGE_VERSION) {
+        printf("Error: unsupported image version %u.\n", h->version);
+        ret = -1;
+    } else if (h->n_sections > (size - sizeof(IMAGE_HEADER)) / sizeof(IMAGE_SECTION)) {
+        printf("Error: truncated section table.\n");
+        ret = -1;
+    } else if (image_checksum(base + sizeof(IMAGE_HEADER), size - sizeof(IMAGE_HEADER)) != h->checksum) {
+        printf("Error: image checksum mismatch.\n");
+        ret = -1;
+    } else if (h->entry >= (uint32_t) mem_size) {
+        printf("Error: entry point %u is outside memory.\n", h->entry);
+        ret = -1;
+    }
+    for (uint32_t i = 0; ret > 0 && i < h->n_sections; i++) {
+        if (sec[i].offset > size || sec[i].size > size - sec[i].offset) {
+            printf("Error: section %u is outside the file.\n", i);
+            ret = -1;
+        } else if (sec[i].type == SECTION_CODE || sec[i].type == SECTION_DATA) {
+            if (sec[i].size % 4 != 0) {
+                printf("Error: section %u is not a whole number of words.\n", i);
+                ret = -1;
+            } else if (sec[i].addr > (uint32_t) mem_size || sec[i].size / 4 > mem_size - sec[i].addr) {
+                printf("Error: section %u does not fit in memory.\n", i);
+                ret = -1;
+            } else
+                memcpy(mem + sec[i].addr, base + sec[i].offset, sec[i].size);
+        }
+    }
+    if (ret > 0)
+        *p_entry = h->entry;
+    munmap(base, size);
+    return ret;
+}
+
+#endif
@@ -0,0 +1,92 @@
+;;; Device demo, e.g. ./icpu -i README.md -d disk.img io-demo.code
+;;; The console input is echoed by the interrupt handler of IRQ_CONSOLE, which
+;;; drains every byte waiting each time it runs; the main program never touches
+;;; the device. At the end of the input the number of bytes is written to block
+;;; 0 of the block device by a DMA transfer, and the machine halts when the
+;;; transfer raises IRQ_BLOCK. Device registers are at -64 to -12 (see the
+;;; simulator), reached with R0 = 0 as the base register.
+
+;;; .data
+.word 0                         ; ISR address, unused: both lines have a vector
+count:
+.word 0                         ; bytes echoed so far
+done:
+.word 0                         ; set by the handler at the end of the input
+
+;;; stack
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+stack_top:
+
+;;; .text
+start:
+    la      sp, stack_top
+    movei   R0, 0
+
+    ;; vectors of IRQ_CONSOLE (1) and IRQ_BLOCK (2)
+    la      R1, console_isr
+    sw      R0, R1, -55
+    la      R1, block_isr
+    sw      R0, R1, -54
+
+    ;; enable these two lines only, and let the console raise its line
+    movei   R1, 6
+    sw      R0, R1, -63
+    movei   R1, 1
+    sw      R0, R1, -30
+
+wait:                           ; nothing else to do until the input has ended
+    la      R1, done
+    lw      R1, R2, 0
+    blez    R2, wait
+
+    ;; DMA: 1 word from count to block 0
+    sw      R0, R0, -16         ; block
+    la      R1, count
+    sw      R0, R1, -15         ; memory address
+    movei   R1, 1
+    sw      R0, R1, -14         ; words
+    movei   R1, 2
+    sw      R0, R1, -13         ; BLK_WRITE, starts the transfer
+idle:
+    jmp     idle
+
+console_isr:
+    push    R1
+    push    R2
+    push    R3
+drain:
+    lw      R0, R2, -32         ; bytes waiting, -1 at the end of the input
+    blez    R2, drained
+    lw      R0, R2, -31         ; next byte
+    put     R2
+    la      R1, count
+    lw      R1, R3, 0
+    addi    R3, R3, 1
+    sw      R1, R3, 0
+    jmp     drain
+drained:
+    addi    R3, R2, 1           ; 0 at the end of the input, 1 if more may come
+    blez    R3, ended
+    jmp     return
+ended:
+    sw      R0, R0, -30         ; stop raising IRQ_CONSOLE
+    movei   R3, 1
+    la      R1, done
+    sw      R1, R3, 0
+return:
+    pop     R3
+    pop     R2
+    pop     R1
+    iret
+
+block_isr:
+    lw      R0, R2, -13         ; BLK_DONE (3) or BLK_ERROR (-1)
+    sw      R0, R0, -13         ; acknowledge
+    halt
@@ -0,0 +1,69 @@
+;;; Spinlock demo for the multi-core simulator, e.g. ./icpu -c 4 mp-lock.code
+;;; Every core starts here with its core number in R0. Each core prints its
+;;; letter three times per turn inside a critical section guarded by xchg, so
+;;; groups of three letters are never interleaved, whatever the schedule.
+
+;;; .data
+.word 0                         ; ISR address
+lock:
+.word 0                         ; 0: free, 1: taken
+
+;;; stack for 4 cores, 4 words each
+stack_base:
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+.word 0
+
+;;; .text
+start:
+    ;; setup ISR (every core does it, the value is the same)
+    movei   R1, 0
+    la      R2, timer_isr
+    sw      R1, R2, 0
+
+    ;; sp <- stack_base + 4 * (core number + 1)
+    la      sp, stack_base
+    addi    sp, sp, 4
+    add     R0, sp
+    add     R0, sp
+    add     R0, sp
+    add     R0, sp
+
+    ;; R3 <- 'A' + core number
+    movei   R3, 65
+    add     R0, R3
+
+    movei   R2, 5               ; number of turns
+turn:
+    la      R0, lock
+    movei   R1, 1
+acquire:
+    xchg    R0, R1, 0           ; R1 <-> lock
+    blez    R1, critical        ; the lock was free, we own it now
+    jmp     acquire
+critical:
+    put     R3
+    put     R3
+    put     R3
+    sw      R0, R1, 0           ; release, R1 is 0 here
+    addi    R2, R2, -1
+    blez    R2, done
+    jmp     turn
+done:
+    halt
+
+timer_isr:
+    iret
@@ -1,5 +1,10 @@
+#define _POSIX_C_SOURCE 200809L  // ftruncate() in coverage.h
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,7 +12,65 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "coverage.h"
+#include "image.h"
+
+/*
+Machine description. The generic build is the machine of the sample programs
+and the translator: 128 words of memory, R0-R63 plus SP (R64), a timer
+interrupt every 5000 cycles. A specialized build (-DMACHINE=name, one Makefile
+target per machine, e.g. make icpu-4p) fixes its own values at compile time:
+    MAX_MEM_SIZE    memory words; a power of two makes every address wrap
+                    around (masked) instead of PC being range-checked
+    GP_REGS         general purpose registers (a power of two, 4 to 64), R0
+                    to R(GP_REGS-1); only the registers a deployment uses
+                    take space in CPU
+An instruction naming any other register than these and SP stops the core
+with an error when it is decoded, on every build.
+    TIMER_PERIOD    cycles between timer interrupts
+*/
+#ifndef MAX_MEM_SIZE
 #define MAX_MEM_SIZE 128  // The max memory size - (unit: word - 32 bits)
+#endif
+#ifndef TIMER_PERIOD
+#define TIMER_PERIOD 5000
+#endif
+#ifndef GP_REGS
+#define GP_REGS 64
+#endif
+#define MAX_CORES 16      // The max number of cores sharing the memory
+
+#define REG_VALID(n) ((n) < GP_REGS || (n) == 64)  // register numbers decode() accepts, 64 is SP
+
+#ifdef MACHINE
+#if GP_REGS < 4 || GP_REGS > 64 || GP_REGS & (GP_REGS - 1)
+#error "GP_REGS must be a power of two from 4 to 64"
+#endif
+// SP is the slot after the general purpose registers; REG() maps a valid register number to its slot
+#define N_REG_SLOTS (GP_REGS + 1)
+#define REG(n) (((n) & (GP_REGS - 1)) | ((n) & 64) / (64 / GP_REGS))
+#define SP_SLOT GP_REGS
+#else
+#define N_REG_SLOTS 65
+#define REG(n) (n)
+#define SP_SLOT 64
+#endif
+
+#if defined(MACHINE) && !(MAX_MEM_SIZE & (MAX_MEM_SIZE - 1))
+#define MEM_MASKED 1
+#define MEM_ADDR(a) ((uint32_t) (a) & (MAX_MEM_SIZE - 1))
+#else
+#define MEM_ADDR(a) (a)
+#endif
+
+/*
+Loads and stores of guest memory. With -p the other cores read and write the
+same words concurrently, so these are relaxed atomics: every word is loaded or
+stored whole, but there is no ordering between cores, only xchg synchronizes.
+On the usual hosts they compile to plain moves.
+*/
+#define MEM_LOAD(cp, a) __atomic_load_n(&(cp)->memory->addr[MEM_ADDR(a)], __ATOMIC_RELAXED)
+#define MEM_STORE(cp, a, v) __atomic_store_n(&(cp)->memory->addr[MEM_ADDR(a)], (v), __ATOMIC_RELAXED)
 
 typedef struct memory {
     uint32_t addr[MAX_MEM_SIZE];
@@ -22,18 +85,301 @@ typedef struct cpu {
 #define PSR_INT_PEND 0x2  // Interrupt pending
 
     // General purpose register
-    int32_t R[65];  // 4 Registers: R[0-3] (R[4-63] are reserved), R[64]-sp
-#define SP R[64]
+    int32_t R[N_REG_SLOTS];  // 4 Registers: R[0-3] (R[4-63] are reserved), R[64]-sp; decode() gives REG(n)
+#define SP R[SP_SLOT]
 
     // Counter
     uint64_t counter;
 } CPU;
 
-typedef struct computer {
+#ifdef CACHE_MODEL
+/*
+Cache model (compiled in with -DCACHE_MODEL). Every parameter below can be overridden
+on the command line, e.g. make cache CACHE_CFG="-DCACHE_L1D_WAYS=4 -DCACHE_L2_SIZE=64".
+Sizes are in words, latencies in cycles. A size of 0 disables that cache level.
+*/
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 4  // words per line, shared by all levels
+#endif
+#ifndef CACHE_L1I_SIZE
+#define CACHE_L1I_SIZE 16
+#endif
+#ifndef CACHE_L1I_WAYS
+#define CACHE_L1I_WAYS 2
+#endif
+#ifndef CACHE_L1D_SIZE
+#define CACHE_L1D_SIZE 16
+#endif
+#ifndef CACHE_L1D_WAYS
+#define CACHE_L1D_WAYS 2
+#endif
+#ifndef CACHE_L2_SIZE
+#define CACHE_L2_SIZE 0  // optional unified L2, off by default
+#endif
+#ifndef CACHE_L2_WAYS
+#define CACHE_L2_WAYS 4
+#endif
+#ifndef CACHE_POLICY
+#define CACHE_POLICY CACHE_LRU
+#endif
+#ifndef CACHE_L1_LATENCY
+#define CACHE_L1_LATENCY 1
+#endif
+#ifndef CACHE_L2_LATENCY
+#define CACHE_L2_LATENCY 10
+#endif
+#ifndef CACHE_MEM_LATENCY
+#define CACHE_MEM_LATENCY 100
+#endif
+
+enum {
+    CACHE_LRU = 0,
+    CACHE_FIFO = 1,
+    CACHE_RANDOM = 2,
+};
+
+typedef struct cache_line {
+    uint32_t tag;
+    uint8_t valid;
+    uint64_t stamp;  // last use (LRU) or fill time (FIFO)
+} CACHE_LINE;
+
+typedef struct cache {
+    const char* name;
+    int sets, ways, latency;
+    CACHE_LINE* lines;  // sets * ways entries
+    struct cache* next;  // next level, NULL means main memory
+
+    // Statistics
+    uint64_t hits, misses;
+    uint64_t miss_cycles;  // cycles spent below this level on misses
+    uint64_t clock;        // access counter used for stamps
+} CACHE;
+#endif
+
+/*
+Record/replay (-r/-R). A recording is a stream of records: a checkpoint of
+the whole machine every 'interval' cycles (and when the run ends), and every
+nondeterministic input: interrupt delivery and, with devices, every value read
+from the device window and every word a block transfer copied into memory.
+Replay seeks to cycle N by restoring the last checkpoint at or before N and
+re-executing, so the cost of a seek is bounded by the interval, not by the
+length of the run. A recording with devices is replayed without them: device
+reads return the recorded values, transfers copy the recorded words, and
+interrupts are taken where the recording took them.
+*/
+#define TRACE_MAGIC 0x43455258  // "XREC" in file byte order
+#define TRACE_VERSION 3  // the header names the machine (memory words, registers, timer period) and devices
+
+enum {
+    TRACE_CHECKPOINT = 1,
+    TRACE_INTERRUPT = 2,
+    TRACE_READ = 3,  // a load from the device window
+    TRACE_DMA = 4,   // a word a block transfer copied into memory
+};
+
+typedef struct checkpoint {
     CPU cpu;
     MEMORY memory;
+} CHECKPOINT;
+
+typedef struct trace_event {
+    uint64_t counter;  // cycle at which the interrupt was taken
+    uint32_t vector;   // handler address
+    uint32_t psr;      // PSR that was saved on the stack
+} TRACE_EVENT;
+
+typedef struct trace_io {
+    uint64_t counter;  // cycle of the load or of the store that started the transfer
+    int32_t addr;      // TRACE_READ: device register, TRACE_DMA: memory word
+    int32_t value;     // the value read, or copied into the word
+} TRACE_IO;
+
+typedef struct trace {
+    FILE* fp;  // open while recording
+    uint64_t interval;
+    int devices;  // the run had devices, replay takes device input and interrupts from the recording
+    // Loaded recording, for replay
+    CHECKPOINT* ck;
+    int n_ck;
+    TRACE_EVENT* ev;
+    int n_ev;
+    TRACE_IO* rd;  // TRACE_READ records
+    int n_rd;
+    TRACE_IO* dma;  // TRACE_DMA records
+    int n_dma;
+} TRACE;
+
+#define REPLAY_DEVICES(cp) ((cp)->trace != NULL && (cp)->trace->fp == NULL && (cp)->trace->devices)
+
+/*
+Breakpoints and watchpoints (-b/-ww/-wr, or debug_watch()). Every memory word
+has a flag byte saying whether it is watched and how. While a DEBUGGER is
+attached the normal run loop looks at the flags of PC and of the word a load
+or store touches, and only a cycle that reaches a flagged word is run by
+computer_run_instrumented(), which does the full checks.
+*/
+#define MAX_WATCHES 32
+
+enum {
+    WATCH_EXEC = 0x1,   // breakpoint: stop before the instruction at addr runs
+    WATCH_READ = 0x2,   // stop after addr is read
+    WATCH_WRITE = 0x4,  // stop after addr is written
+};
+
+typedef struct watch {
+    int type;
+    uint32_t addr;
+    int cond_reg;  // -1: unconditional, otherwise trigger only if R[cond_reg] <cond_op> cond_value
+    char cond_op;  // '<', '=', '>' or '!' (not equal)
+    int32_t cond_value;
+    uint64_t hits;  // times addr was reached, whether or not the condition held
+} WATCH;
+
+typedef struct debugger {
+    uint8_t flags[MAX_MEM_SIZE];  // WATCH_* bits of every word
+    WATCH watch[MAX_WATCHES];
+    int n_watch;
+} DEBUGGER;
+
+/*
+Memory-mapped devices (-i/-d). Loads, stores and xchg whose address is in the
+last 128 words of the address space (-128 to -1, reachable with one movei) go
+to the device bus of core 0 instead of memory:
+    -64 to -49    interrupt controller
+    -32 to -30    console input, fed from a host file by a host thread
+    -16 to -12    block device, a host file mapped into the simulator
+Addresses without a register read as 0 and ignore writes, and so does the
+whole window on the other cores and when no device is attached (the window is
+then the only change from a machine without devices).
+
+The interrupt controller turns the single timer interrupt into IRQ_TIMER and
+adds one line per device. A timer tick is latched by the controller until
+its interrupt is taken, so a tick is not lost while another line is served.
+Device lines are level-triggered: a device keeps its line raised until the
+guest has served it. check_interrupt() takes the lowest numbered line that is
+raised and enabled, and jumps to its vector, or to the handler at memory
+address 0 if the vector is 0; IO_INTC_CURRENT tells a shared handler which
+line it was. With devices PSR_INT_PEND shows whether any enabled line is
+raised. Interrupt entry and iret are unchanged.
+*/
+#define IO_BASE 0xffffff80u
+#define IS_IO(a) ((uint32_t) (a) >= IO_BASE)
+#define N_IRQ 8
+#define RING_SIZE 65536  // bytes of console input buffered ahead of the guest, a power of two
+#define BLOCK_WORDS 8    // words per block of the block device
+#define CON_POLL 1024    // cycles between two looks at the console producer while no byte is known to wait
+
+enum {
+    // Interrupt controller
+    IO_INTC_PENDING = -64,  // r: raised lines, bit n for IRQ n
+    IO_INTC_ENABLE = -63,   // rw: enabled lines, only IRQ_TIMER at power on
+    IO_INTC_CURRENT = -62,  // r: the line of the last interrupt taken
+    IO_INTC_VECTOR = -56,   // rw: -56 + n is the handler address of IRQ n, 0 for the one at address 0
+    // Console input
+    IO_CON_STATUS = -32,  // r: bytes waiting, or -1 once the input has ended and all of it was read
+    IO_CON_DATA = -31,    // r: the next byte, -1 if none is waiting
+    IO_CON_CTRL = -30,    // rw: 1 raises IRQ_CONSOLE while bytes are waiting or the input has ended
+    // Block device
+    IO_BLK_BLOCK = -16,  // rw: first block of the transfer
+    IO_BLK_ADDR = -15,   // rw: memory address of the transfer
+    IO_BLK_COUNT = -14,  // rw: number of words to transfer
+    IO_BLK_CMD = -13,    // w: BLK_READ or BLK_WRITE starts a transfer, BLK_IDLE acknowledges it; r: BLK_* state
+    IO_BLK_SIZE = -12,   // r: number of blocks
+};
+
+enum {
+    IRQ_TIMER = 0,
+    IRQ_CONSOLE = 1,  // bytes waiting (or end of input) and IO_CON_CTRL is 1
+    IRQ_BLOCK = 2,    // a transfer has finished and is not acknowledged yet
+};
+
+enum {
+    BLK_IDLE = 0,
+    BLK_READ = 1,   // block device to memory
+    BLK_WRITE = 2,  // memory to block device
+    BLK_DONE = 3,
+    BLK_ERROR = -1,  // the transfer was outside the device or the memory, nothing was copied
+};
+
+/*
+Single-producer single-consumer byte queue between the host thread reading
+the console input (producer) and the core reading IO_CON_DATA (consumer). Each
+side only writes its own index, so no lock is needed; head and tail live on
+separate cache lines so the two threads do not share a line for every byte.
+*/
+typedef struct ring {
+    uint32_t head __attribute__((aligned(64)));  // bytes written, stored by the producer
+    uint32_t tail __attribute__((aligned(64)));  // bytes read, stored by the consumer
+    int eof;                                      // set by the producer after the last byte
+    uint8_t buf[RING_SIZE];
+} RING;
+
+typedef struct bus {
+    // Interrupt controller
+    uint32_t enable;
+    int32_t current;
+    uint32_t vector[N_IRQ];
+    int timer;  // a timer tick is waiting for its interrupt
+    // Console input, NULL if none
+    RING* input;
+    int input_fd;
+    int32_t con_ctrl;
+    uint32_t con_head;  // the producer's head when the core last looked
+    int con_eof;        // the core has seen the end of the input
+    int con_poll;       // cycles until the core looks at the producer again
+    // Block device, NULL if none
+    uint32_t* disk;
+    size_t disk_size;  // bytes mapped
+    uint32_t disk_blocks;
+    int32_t blk_block, blk_addr, blk_count, blk_state;
+} BUS;
+
+/*
+One core of the machine. All cores share the same MEMORY; each has its own
+registers, timer and interrupt state.
+*/
+typedef struct computer {
+    int id;  // core number, also placed in R0 at power on
+    CPU cpu;
+    MEMORY* memory;
+    TRACE* trace;  // NULL unless recording or replaying
+    int quiet;     // suppress console output (replay re-execution)
+    FILE* console;  // where put writes, stdout if NULL
+    DEBUGGER* debugger;  // NULL unless a breakpoint or watchpoint is set
+    uint32_t access[8];  // watched words touched in the current cycle (WATCH_READ/WRITE in the top bits)
+    int n_access;
+    int resume;  // skip the breakpoint at PC once when continuing after a stop
+    uint8_t* coverage;  // COV_* bits of every word (see coverage.h), NULL unless -C
+    BUS* bus;           // devices, only on core 0 and NULL unless -i or -d
+#ifdef CACHE_MODEL
+    CACHE *l1i, *l1d, *l2;
+    uint64_t stall_cycles;  // total memory latency seen by the CPU
+#endif
 } COMPUTER;
 
+/*
+A timer tick raises the interrupt if interrupts are enabled. With devices the
+controller latches it as IRQ_TIMER whatever PSR says, and check_interrupt()
+takes it once interrupts are enabled
+*/
+#define TIMER_RAISE(cp)                                \
+    do {                                               \
+        if ((cp)->bus != NULL)                         \
+            (cp)->bus->timer = 1;                      \
+        else if ((cp)->cpu.PSR & PSR_INT_EN)           \
+            (cp)->cpu.PSR |= PSR_INT_PEND;             \
+    } while (0)
+
+#ifdef CACHE_MODEL
+// An L1 hit is part of the cycle, only the latency beyond it stalls the CPU
+#define CACHE_FETCH(cp, a) ((cp)->stall_cycles += cache_access((cp)->l1i, (a)) - CACHE_L1_LATENCY)
+#define CACHE_DATA(cp, a) ((cp)->stall_cycles += cache_access((cp)->l1d, (a)) - CACHE_L1_LATENCY)
+#else
+#define CACHE_FETCH(cp, a)
+#define CACHE_DATA(cp, a)
+#endif
+
 enum {
     OP_HALT = 0x00,
     OP_NOP = 0x01,
@@ -50,11 +396,56 @@ enum {
     OP_JMP = 0x0c,
     OP_IRET = 0x10,
     OP_PUT = 0x11,
+    OP_XCHG = 0x12,
     OP_NONE = 0xff,
 };
 
 int computer_load_init(COMPUTER*, char*);
+int cpu_init(COMPUTER*, int, uint32_t);
 int cpu_cycle(COMPUTER*);
+int computer_run(COMPUTER*, uint64_t);
+int computer_run_instrumented(COMPUTER*, uint64_t);
+int run_round_robin(COMPUTER*, int, uint64_t);
+int run_parallel(COMPUTER*, int);
+void* core_thread(void*);
+
+int record_run(COMPUTER*, char*, uint64_t);
+int record_checkpoint(COMPUTER*);
+int trace_interrupt(COMPUTER*);
+TRACE_EVENT* trace_event(TRACE*, uint64_t);
+int trace_io(COMPUTER*, uint32_t, int32_t, int32_t);
+int trace_find(TRACE_IO*, int, uint64_t);
+int replay(char*);
+int replay_seek(COMPUTER*, uint64_t);
+int replay_reverse_continue(COMPUTER*, uint32_t);
+
+int debug_watch(DEBUGGER*, int, uint32_t, int, char, int32_t);
+int debug_watch_parse(DEBUGGER*, int, char*);
+int debug_unwatch(DEBUGGER*, int);
+int debug_access(COMPUTER*, uint32_t, int);
+int debug_watched(COMPUTER*, uint8_t*);
+int debug_trigger(COMPUTER*, uint32_t, int, uint32_t*);
+int print_watches(DEBUGGER*);
+
+int bus_init(BUS*, char*, char*);
+int bus_close(BUS*);
+int32_t bus_read(COMPUTER*, int32_t);
+int32_t bus_register(COMPUTER*, int32_t);
+int bus_write(COMPUTER*, int32_t, int32_t);
+uint32_t bus_lines(COMPUTER*);
+int32_t console_waiting(BUS*);
+int console_line(BUS*);
+int block_transfer(COMPUTER*, int);
+void* console_thread(void*);
+uint32_t ring_write(RING*, const uint8_t*, uint32_t);
+int ring_read(RING*);
+
+void stop_on_sigint(int);
+#define STOP_CHECK 65536  // cycles run between two looks at 'stop'
+
+volatile sig_atomic_t stop = 0;  // set on Ctrl-C or at a breakpoint, ends the run cleanly
+uint64_t max_cycles = UINT64_MAX;  // -n: cycle limit per core
+uint32_t image_hash;               // hash of the memory right after loading, identifies the program
 
 int print_cpu(COMPUTER*);
 int print_memory(COMPUTER*);
@@ -66,6 +457,14 @@ int execute(COMPUTER*, uint8_t*, uint8_t*, uint8_t*, int8_t*);
 int timer_tick(COMPUTER*);
 int check_interrupt(COMPUTER*);
 
+#ifdef CACHE_MODEL
+CACHE* cache_create(const char*, int, int, int, CACHE*);
+uint32_t cache_access(CACHE*, uint32_t);
+int computer_cache_init(COMPUTER*);
+int print_cache(CACHE*);
+int print_cache_stats(COMPUTER*);
+#endif
+
 int main(int argc, char** args) {
     printf(
         "----------------------------------------------------------------\n|"
@@ -73,42 +472,294 @@ int main(int argc, char** args) {
         "            Tianyi YANG (tyyang@cse.cuhk.edu.hk)             "
         "|\n----------------------------------------------------------------"
         "\n");
-    if (argc != 3) {
-        printf("\nUsage: ./icpu ios 16\n");
-        printf("\t ios: the os for interrupts; 16: the initial PC\n \n");
+
+    // Options: -c cores, -q round-robin quantum (cycles), -p one host thread per core,
+    // -n cycle limit, -r record to a file (-k checkpoint interval), -R replay a recording,
+    // -b/-wr/-ww breakpoints and watchpoints, -C merge code coverage into a file, -i/-d devices
+    int n_cores = 1, parallel = 0;
+    uint64_t quantum = 1000, interval = 1000000;
+    char *record_file = NULL, *replay_file = NULL, *coverage_file = NULL, *input_file = NULL, *disk_file = NULL;
+    static DEBUGGER debugger;
+    static uint8_t coverage[MAX_MEM_SIZE];
+    static BUS bus;
+    while (argc > 1 && args[1][0] == '-') {
+        if (!strcmp(args[1], "-p")) {
+            parallel = 1;
+            args++, argc--;
+        } else if (!strcmp(args[1], "-c") && argc > 2) {
+            n_cores = atoi(args[2]);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-q") && argc > 2) {
+            quantum = strtoull(args[2], NULL, 10);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-n") && argc > 2) {
+            max_cycles = strtoull(args[2], NULL, 10);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-r") && argc > 2) {
+            record_file = args[2];
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-k") && argc > 2) {
+            interval = strtoull(args[2], NULL, 10);
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-R") && argc > 2) {
+            replay_file = args[2];
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-C") && argc > 2) {
+            coverage_file = args[2];
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-i") && argc > 2) {
+            input_file = args[2];
+            args += 2, argc -= 2;
+        } else if (!strcmp(args[1], "-d") && argc > 2) {
+            disk_file = args[2];
+            args += 2, argc -= 2;
+        } else if ((!strcmp(args[1], "-b") || !strcmp(args[1], "-wr") || !strcmp(args[1], "-ww")) && argc > 2) {
+            int type = (args[1][1] == 'b') ? WATCH_EXEC : (args[1][2] == 'r') ? WATCH_READ : WATCH_WRITE;
+            if (debug_watch_parse(&debugger, type, args[2]) < 0) {
+                printf("Error: invalid watch %s %s\n", args[1], args[2]);
+                exit(-1);
+            }
+            args += 2, argc -= 2;
+        } else
+            break;
+    }
+    if (replay_file != NULL)
+        return replay(replay_file);
+    if ((argc != 2 && argc != 3) || n_cores < 1 || n_cores > MAX_CORES || quantum == 0 || interval == 0 ||
+        (record_file != NULL && n_cores > 1)) {
+        printf("\nUsage: ./icpu [-c cores] [-q quantum | -p] [-n cycles] [-r trace [-k interval]]\n");
+        printf("              [-b addr[:cond]] [-wr addr[:cond]] [-ww addr[:cond]] [-C coverage]\n");
+        printf("              [-i input] [-d disk] ios [16]\n");
+        printf("       ./icpu -R trace\n");
+        printf("\t ios: the os for interrupts; 16: the initial PC (default: the image entry point)\n");
+        printf("\t -c: number of cores (1-%d) sharing the memory, each starts with its number in R0\n", MAX_CORES);
+        printf("\t -q: cycles each core runs per turn of the round-robin scheduler (default 1000)\n");
+        printf("\t -p: run every core on its own host thread instead\n");
+        printf("\t -n: stop every core after this many cycles\n");
+        printf("\t -r: record a single-core run, with a checkpoint every -k cycles (default 1000000)\n");
+        printf("\t -R: replay a recording interactively (seek, reverse step/continue)\n");
+        printf("\t -b, -wr, -ww: stop at a breakpoint, or after a read/write of a memory word,\n");
+        printf("\t               optionally only if a register condition holds, e.g. -ww 27:R3=66\n");
+        printf("\t -C: merge the instructions and branch directions executed into a coverage file\n");
+        printf("\t -i: console input device fed from a file (- for stdin), -d: block device backed by a file\n");
+#ifdef MACHINE
+        printf("\t machine %s: %d words, R0-R%d and sp, timer every %d cycles\n", MACHINE, MAX_MEM_SIZE, GP_REGS - 1,
+               TIMER_PERIOD);
+#endif
+        printf(" \n");
         exit(-1);
     }
 
-    COMPUTER comp;
+    static MEMORY memory;
+    static COMPUTER core[MAX_CORES];
 
     // Initialize: Load the program into the memory, and initialize all
     // regisrters;
-    if (computer_load_init(&comp, args[1]) < 0) {
+    core[0].memory = &memory;
+    int versioned = computer_load_init(&core[0], args[1]);
+    if (versioned < 0) {
         printf("Error: computer_poweron_init()\n");
         exit(-1);
     }
 
     // Set PC and start the cpu execution cycle
-    comp.cpu.PC = atoi(args[2]);
-    if (comp.cpu.PC >= MAX_MEM_SIZE || comp.cpu.PC < 0) {
-        printf("Error: start_addr should be in 0-127.\n");
+    uint32_t pc = core[0].cpu.PC;
+    if (argc == 3)
+        pc = atoi(args[2]);
+    else if (!versioned) {
+        printf("Error: a legacy image has no entry point, give the initial PC.\n");
         exit(-1);
     }
+    if (pc >= MAX_MEM_SIZE) {
+        printf("Error: start_addr should be in 0-%d.\n", MAX_MEM_SIZE - 1);
+        exit(-1);
+    }
+
+    image_hash = image_checksum((uint8_t*) memory.addr, sizeof(memory.addr));
+
+    if (input_file != NULL || disk_file != NULL) {
+        if (bus_init(&bus, input_file, disk_file) < 0)
+            exit(-1);
+        core[0].bus = &bus;
+    }
+
+    int i;
+    for (i = 0; i < n_cores; i++) {
+        core[i].memory = &memory;
+        if (debugger.n_watch > 0)
+            core[i].debugger = &debugger;
+        if (coverage_file != NULL)
+            core[i].coverage = coverage;
+        cpu_init(&core[i], i, pc);
+#ifdef CACHE_MODEL
+        if (computer_cache_init(&core[i]) < 0) {
+            printf("Error: computer_cache_init()\n");
+            exit(-1);
+        }
+#endif
+    }
+    // The sample programs never halt, so end the run on Ctrl-C like on a halt: recordings are
+    // closed, and cache statistics, watch hit counts and coverage are still reported
+    signal(SIGINT, stop_on_sigint);
 
     // Execute CPU cyles: fetch, decode, execution, and increment PC; Repeat
-    while (1) {
+    if (record_file != NULL)
+        record_run(&core[0], record_file, interval);
+    else if (n_cores == 1)
+        computer_run(&core[0], max_cycles);
+    else if (parallel)
+        run_parallel(core, n_cores);
+    else
+        run_round_robin(core, n_cores, quantum);
+
+#ifdef CACHE_MODEL
+    for (i = 0; i < n_cores; i++)
+        print_cache_stats(&core[i]);
+#endif
+    if (debugger.n_watch > 0)
+        print_watches(&debugger);
+    if (coverage_file != NULL && coverage_merge(coverage_file, image_hash, coverage, MAX_MEM_SIZE) < 0)
+        exit(-1);
+    if (core[0].bus != NULL && bus_close(&bus) < 0)
+        exit(-1);
+    return 0;
+}
+
+/*
+Set coverage bits; cores running on other threads may update the same byte
+*/
+#define COVERAGE_MARK(c, bits)                                  \
+    do {                                                        \
+        if ((*(c) & (bits)) != (bits))                          \
+            __atomic_or_fetch((c), (bits), __ATOMIC_RELAXED);   \
+    } while (0)
+
+/*
+Run up to 'cycles' CPU cycles on one core, with 'flags' of cp->debugger or NULL.
+Returns -1 once the core has halted or the run was stopped, 1 if it stopped
+at a breakpoint or watchpoint, 0 if it is still runnable. What a run needs is
+decided once here, not in every cycle: 'stop' is looked at every STOP_CHECK
+cycles, and the loop below is cpu_cycle() spelled out, with the timer
+counting down to its next tick instead of dividing, and check_interrupt()
+only called when an interrupt can be taken. Coverage is marked right after
+the decode, from a local pointer. With a debugger, debug_watched() looks at
+the flags of the words the next instruction touches before it is fetched; a
+cycle that reaches a flagged word is run by computer_run_instrumented(), and
+the words of an interrupt entry are checked after check_interrupt().
+*/
+static inline __attribute__((always_inline)) int computer_run_loop(COMPUTER* cp, uint64_t cycles, uint8_t* flags) {
+    uint8_t* cov = cp->coverage;
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    uint64_t n, tick;
+    int i, hit, r;
+
+    tick = TIMER_PERIOD - cp->cpu.counter % TIMER_PERIOD;  // cycles until timer_tick() would fire
+    while (cycles > 0) {
+        n = cycles < STOP_CHECK ? cycles : STOP_CHECK;
+        cycles -= n;
+        while (n--) {
 #ifdef DEBUG
-        printf("\n\nBefore\n");
-        print_cpu(&comp);
+            printf("\n\nBefore\n");
+            print_cpu(cp);
 #endif
-        if (cpu_cycle(&comp) < 0)
-            break;
+            if (flags != NULL && debug_watched(cp, flags)) {
+                if ((r = computer_run_instrumented(cp, 1)) != 0)
+                    return r;
+                if (--tick == 0)
+                    tick = TIMER_PERIOD;  // timer_tick() has raised it
+                continue;
+            }
+            if (fetch(cp) < 0)
+                return -1;
+            if (decode(cp->cpu.IR, &opcode, &sreg, &treg, &imm) < 0)
+                return -1;
+            if (cov != NULL) {
+                COVERAGE_MARK(&cov[MEM_ADDR(cp->cpu.PC)], COV_EXEC);
+                if (opcode == OP_BLEZ)
+                    COVERAGE_MARK(&cov[MEM_ADDR(cp->cpu.PC)], cp->cpu.R[sreg] <= 0 ? COV_TAKEN : COV_NOT_TAKEN);
+            }
+            if (execute(cp, &opcode, &sreg, &treg, &imm) < 0)
+                return -1;
+            cp->cpu.counter++;
+            if (--tick == 0) {
+                tick = TIMER_PERIOD;
+                TIMER_RAISE(cp);
+            }
+            if (cp->cpu.PSR & PSR_INT_EN && (cp->cpu.PSR & PSR_INT_PEND || cp->bus != NULL)) {
+                cp->n_access = 0;
+                check_interrupt(cp);
+                // check_interrupt() notes the stack words and word 0 of an interrupt entry
+                for (hit = 0, i = 0; flags != NULL && i < cp->n_access; i++)
+                    hit |= debug_trigger(cp, cp->access[i] & 0xffffff, cp->access[i] >> 24, NULL);
+                if (hit)
+                    return 1;
+            }
 #ifdef DEBUG
-        printf("After\n");
-        print_cpu(&comp);
+            printf("After\n");
+            print_cpu(cp);
 #endif
+        }
+        if (stop)
+            return -1;
     }
+    return 0;
+}
+
+/*
+Run up to 'cycles' CPU cycles on one core, see computer_run_loop(). Its two
+copies keep a run without a debugger from testing for one in every cycle.
+*/
+int computer_run(COMPUTER* cp, uint64_t cycles) {
+    if (cp->debugger)
+        return computer_run_loop(cp, cycles, cp->debugger->flags);
+    return computer_run_loop(cp, cycles, NULL);
+}
+
+/*
+Deterministic multi-core mode: one host thread runs each core for 'quantum'
+cycles in turn until every core has halted.
+*/
+int run_round_robin(COMPUTER* core, int n_cores, uint64_t quantum) {
+    uint8_t halted[MAX_CORES] = {0};
+    int i, running = n_cores;
+    while (running > 0) {
+        for (i = 0; i < n_cores; i++) {
+            uint64_t left = max_cycles - core[i].cpu.counter;
+            int ret = (halted[i] || left == 0) ? -1 : computer_run(&core[i], left < quantum ? left : quantum);
+            if (ret > 0)
+                return 0;  // a breakpoint stops the whole machine
+            if (!halted[i] && ret < 0) {
+                halted[i] = 1;
+                running--;
+            }
+        }
+    }
+    return 0;
+}
 
+void* core_thread(void* arg) {
+    if (computer_run((COMPUTER*) arg, max_cycles) > 0)
+        stop = 1;  // a breakpoint stops the other cores too
+    return NULL;
+}
+
+/*
+Parallel multi-core mode: every core runs freely on its own host thread.
+Each load and store is atomic (see MEM_LOAD) but not ordered with respect to
+the other cores; xchg is the only synchronization.
+*/
+int run_parallel(COMPUTER* core, int n_cores) {
+    pthread_t thread[MAX_CORES];
+    int i;
+    for (i = 0; i < n_cores; i++) {
+        if (pthread_create(&thread[i], NULL, core_thread, &core[i]) != 0) {
+            printf("Error: pthread_create()\n");
+            exit(-1);
+        }
+    }
+    for (i = 0; i < n_cores; i++)
+        pthread_join(thread[i], NULL);
     return 0;
 }
 
@@ -131,12 +782,19 @@ int cpu_cycle(COMPUTER* cp) {
 
 int fetch(COMPUTER* cp) {
     // Fetch the instruction to IR from the memory pointed by PC
+#ifdef MEM_MASKED
+    CACHE_FETCH(cp, MEM_ADDR(cp->cpu.PC));
+    cp->cpu.IR = MEM_LOAD(cp, cp->cpu.PC);
+    return 0;
+#else
     if (cp->cpu.PC >= MAX_MEM_SIZE)
         return -1;
     else {
-        cp->cpu.IR = cp->memory.addr[cp->cpu.PC];
+        CACHE_FETCH(cp, cp->cpu.PC);
+        cp->cpu.IR = MEM_LOAD(cp, cp->cpu.PC);
         return 0;
     }
+#endif
 }
 
 int decode(uint32_t instr, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg, int8_t* p_imm) {
@@ -148,8 +806,13 @@ int decode(uint32_t instr, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg,
     uint8_t* p = (uint8_t*) &instr;
 
     *p_opcode = *(p + 3);
-    *p_sreg = *(p + 2);
-    *p_treg = *(p + 1);
+    if (!REG_VALID(*(p + 2)) || !REG_VALID(*(p + 1))) {
+        printf("Error: instruction 0x%08x names R%d, the machine has R0-R%d and sp\n", instr,
+               REG_VALID(*(p + 2)) ? *(p + 1) : *(p + 2), GP_REGS - 1);
+        return -1;
+    }
+    *p_sreg = REG(*(p + 2));  // register slot, the register number itself on the generic machine
+    *p_treg = REG(*(p + 1));
     *p_imm = (int8_t*) *p;
 
     return 0;
@@ -196,14 +859,24 @@ int execute(COMPUTER* cp, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg, i
 #ifdef DEBUG
         printf("Instruction: lw R%d, R%d, %d\n", *p_sreg, *p_treg, *p_imm);
 #endif
-        cp->cpu.R[*p_treg] = cp->memory.addr[cp->cpu.R[*p_sreg] + *p_imm];
+        if (IS_IO(cp->cpu.R[*p_sreg] + *p_imm))
+            cp->cpu.R[*p_treg] = bus_read(cp, cp->cpu.R[*p_sreg] + *p_imm);
+        else {
+            CACHE_DATA(cp, MEM_ADDR(cp->cpu.R[*p_sreg] + *p_imm));
+            cp->cpu.R[*p_treg] = MEM_LOAD(cp, cp->cpu.R[*p_sreg] + *p_imm);
+        }
         cp->cpu.PC++;
         break;
     case OP_SW:
 #ifdef DEBUG
         printf("Instruction: sw R%d, R%d, %d\n", *p_sreg, *p_treg, *p_imm);
 #endif
-        cp->memory.addr[cp->cpu.R[*p_sreg] + *p_imm] = cp->cpu.R[*p_treg];
+        if (IS_IO(cp->cpu.R[*p_sreg] + *p_imm))
+            bus_write(cp, cp->cpu.R[*p_sreg] + *p_imm, cp->cpu.R[*p_treg]);
+        else {
+            CACHE_DATA(cp, MEM_ADDR(cp->cpu.R[*p_sreg] + *p_imm));
+            MEM_STORE(cp, cp->cpu.R[*p_sreg] + *p_imm, cp->cpu.R[*p_treg]);
+        }
         cp->cpu.PC++;
         break;
     case OP_BLEZ:
@@ -240,14 +913,16 @@ int execute(COMPUTER* cp, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg, i
         printf("Instruction: push R%d\n", *p_sreg);
 #endif
         cp->cpu.SP--;
-        cp->memory.addr[cp->cpu.SP] = cp->cpu.R[*p_sreg];
+        CACHE_DATA(cp, MEM_ADDR(cp->cpu.SP));
+        MEM_STORE(cp, cp->cpu.SP, cp->cpu.R[*p_sreg]);
         cp->cpu.PC++;
         break;
     case OP_POP:
 #ifdef DEBUG
         printf("Instruction: pop R%d\n", *p_treg);
 #endif
-        cp->cpu.R[*p_treg] = cp->memory.addr[cp->cpu.SP];
+        CACHE_DATA(cp, MEM_ADDR(cp->cpu.SP));
+        cp->cpu.R[*p_treg] = MEM_LOAD(cp, cp->cpu.SP);
         cp->cpu.SP++;
         cp->cpu.PC++;
         break;
@@ -255,17 +930,36 @@ int execute(COMPUTER* cp, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg, i
 #ifdef DEBUG
         printf("Instruction: iret\n");
 #endif
-        cp->cpu.PC = cp->memory.addr[cp->cpu.SP];
+        CACHE_DATA(cp, MEM_ADDR(cp->cpu.SP));
+        cp->cpu.PC = MEM_LOAD(cp, cp->cpu.SP);
         cp->cpu.SP++;
-        cp->cpu.PSR = cp->memory.addr[cp->cpu.SP];
+        CACHE_DATA(cp, MEM_ADDR(cp->cpu.SP));
+        cp->cpu.PSR = MEM_LOAD(cp, cp->cpu.SP);
         cp->cpu.SP++;
         cp->cpu.PSR &= ~(PSR_INT_PEND);  // set pending bit to 0
         break;
+    case OP_XCHG:
+#ifdef DEBUG
+        printf("Instruction: xchg R%d, R%d, %d\n", *p_sreg, *p_treg, *p_imm);
+#endif
+        // Atomically swap R[treg] with the memory word, the building block for locks between cores
+        if (IS_IO(cp->cpu.R[*p_sreg] + *p_imm)) {
+            int32_t old = bus_read(cp, cp->cpu.R[*p_sreg] + *p_imm);  // devices are only used by core 0
+            bus_write(cp, cp->cpu.R[*p_sreg] + *p_imm, cp->cpu.R[*p_treg]);
+            cp->cpu.R[*p_treg] = old;
+        } else {
+            CACHE_DATA(cp, MEM_ADDR(cp->cpu.R[*p_sreg] + *p_imm));
+            cp->cpu.R[*p_treg] = __atomic_exchange_n(&cp->memory->addr[MEM_ADDR(cp->cpu.R[*p_sreg] + *p_imm)],
+                                                     cp->cpu.R[*p_treg], __ATOMIC_SEQ_CST);
+        }
+        cp->cpu.PC++;
+        break;
     case OP_PUT:
 #ifdef DEBUG
         printf("Instruction: put R%d (%c)\n", *p_sreg, cp->cpu.R[*p_sreg]);
 #else
-        printf("%c", cp->cpu.R[*p_sreg]);
+        if (!cp->quiet)
+            putc(cp->cpu.R[*p_sreg], cp->console ? cp->console : stdout);
 #endif
         cp->cpu.PC++;
         break;
@@ -277,12 +971,12 @@ int execute(COMPUTER* cp, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg, i
 }
 
 int timer_tick(COMPUTER* cp) {
-    // Increment counter by one; when "counter%5000 == 0", set up the interrupt
+    // Increment counter by one; when "counter%TIMER_PERIOD == 0", set up the interrupt
     // pending
     // bit if the interrupt enable bit is 1
     cp->cpu.counter++;
-    if (cp->cpu.PSR & PSR_INT_EN && cp->cpu.counter % 5000 == 0)
-        cp->cpu.PSR |= PSR_INT_PEND;
+    if (cp->cpu.counter % TIMER_PERIOD == 0)
+        TIMER_RAISE(cp);
 #ifdef DEBUG
     printf("In timer_tick(): CPU Counter = %d, PSR_EN = %d, PSR_PEND = %d\n", cp->cpu.counter, cp->cpu.PSR & PSR_INT_EN,
            cp->cpu.PSR & PSR_INT_PEND);
@@ -291,55 +985,92 @@ int timer_tick(COMPUTER* cp) {
 }
 
 int check_interrupt(COMPUTER* cp) {
-    // If the interrupt enable bit and the interrupt pending bit are both one,
-    if (cp->cpu.PSR & PSR_INT_EN && cp->cpu.PSR & PSR_INT_PEND) {
+    // If the interrupt enable bit and the interrupt pending bit are both one; with devices the
+    // pending bit is set while an enabled line of the interrupt controller is raised, and the
+    // lowest such line is taken. A replay of a run with devices takes the recorded interrupts
+    int irq = -1;
+    TRACE_EVENT* ev = NULL;
+    if (REPLAY_DEVICES(cp)) {
+        // Lines were only looked at while interrupts were enabled, as computer_run() does
+        if (cp->cpu.PSR & PSR_INT_EN) {
+            ev = trace_event(cp->trace, cp->cpu.counter);
+            cp->cpu.PSR = ev ? ev->psr : cp->cpu.PSR & ~PSR_INT_PEND;
+            irq = ev ? IRQ_TIMER : -1;  // any line, the PSR and handler are the recorded ones
+        }
+    } else if (cp->bus != NULL) {
+        uint32_t pending = bus_lines(cp) & cp->bus->enable;
+        cp->cpu.PSR = (cp->cpu.PSR & ~PSR_INT_PEND) | (pending ? PSR_INT_PEND : 0);
+        if (pending)
+            irq = __builtin_ctz(pending);
+    } else if (cp->cpu.PSR & PSR_INT_PEND)
+        irq = IRQ_TIMER;
+    if (irq >= 0 && cp->cpu.PSR & PSR_INT_EN) {
+        uint32_t vector = ev ? ev->vector : cp->bus ? cp->bus->vector[irq] : 0;
+        if (cp->debugger) {
+            debug_access(cp, cp->cpu.SP - 1, WATCH_WRITE);
+            debug_access(cp, cp->cpu.SP - 2, WATCH_WRITE);
+            if (vector == 0)
+                debug_access(cp, 0, WATCH_READ);
+        }
         // Save PSR and PC onto the stack
         cp->cpu.SP -= 1;
-        cp->memory.addr[cp->cpu.SP] = cp->cpu.PSR;
+        CACHE_DATA(cp, MEM_ADDR(cp->cpu.SP));
+        MEM_STORE(cp, cp->cpu.SP, cp->cpu.PSR);
         cp->cpu.SP -= 1;
-        cp->memory.addr[cp->cpu.SP] = cp->cpu.PC;
-        // Clear up the interrupt pending bit (=0) and Disable the interrupt
-        // (the interrupt enable bit =s 0) so no nested interrupts
-        cp->cpu.PSR &= 0xfffffffc;
+        CACHE_DATA(cp, MEM_ADDR(cp->cpu.SP));
+        MEM_STORE(cp, cp->cpu.SP, cp->cpu.PC);
+        // Disable the interrupt (the interrupt enable bit = 0) so no nested interrupts, and
+        // clear up the line taken: the timer's pending bit, or its latch in the controller.
+        // Device lines stay raised until the handler has served them
+        cp->cpu.PSR &= ~PSR_INT_EN;
+        if (cp->bus == NULL && ev == NULL)
+            cp->cpu.PSR &= ~PSR_INT_PEND;
+        else if (cp->bus != NULL && irq == IRQ_TIMER)
+            cp->bus->timer = 0;
         // Jump to the interrupt handler (the address is stored at memory
-        // address 0)
-        cp->cpu.PC = cp->memory.addr[0];
+        // address 0, unless the line has its own vector)
+        if (vector == 0 && ev == NULL) {
+            CACHE_DATA(cp, 0);
+            vector = MEM_LOAD(cp, 0);
+        }
+        cp->cpu.PC = vector;
+        if (cp->bus)
+            cp->bus->current = irq;
+        if (cp->trace && ev == NULL)
+            trace_interrupt(cp);
     }
     return 0;
 }
 
+/*
+Returns 1 if the image carries an entry point (PC is set to it), 0 for a
+legacy headerless image (PC is 0)
+*/
 int computer_load_init(COMPUTER* cp, char* file) {
-    // load the image file
-    int fd;   // file descriptor for image file
-    int ret;  // size of the image file, modified by read()
-
-    // open the file
-    if ((fd = open(file, O_RDONLY)) < 0) {
-        printf("Error: open().\n");
+    // load the image file, either versioned (see image.h) or a legacy dump
+    uint32_t entry = 0;
+    int ret = image_load(file, cp->memory->addr, MAX_MEM_SIZE, &entry);
+    if (ret < 0)
         exit(-1);
-    }
 
-    // read from the program file (the program file <= 256 bytes) into the
-    // memory
-    if ((ret = read(fd, &cp->memory, MAX_MEM_SIZE * 4)) < 0) {
-        printf("Error: read().\n");
-        exit(-1);
-    } else if (ret > (MAX_MEM_SIZE * 4)) {
-        printf("Error: read() - Program is too big. \n");
-        exit(-1);
-    }
+    cpu_init(cp, cp->id, entry);
+    return ret;
+}
 
+int cpu_init(COMPUTER* cp, int id, uint32_t pc) {
     // Initialize all registers
+    memset(&cp->cpu, 0, sizeof(CPU));
+    cp->id = id;
     cp->cpu.SP = 0;     // Stack pointer
-    cp->cpu.PC = 0;     // Program counter
+    cp->cpu.PC = pc;    // Program counter
     cp->cpu.IR = 0;     // Instruction regiser
     cp->cpu.PSR = 0x1;  // Processor Status Register, enable interrupt
 
     // General purpose register
-    cp->cpu.R[0] = 0;  // General register No. 0
-    cp->cpu.R[1] = 0;  // General register No. 1
-    cp->cpu.R[2] = 0;  // General register No. 2
-    cp->cpu.R[3] = 0;  // General register No. 3
+    cp->cpu.R[REG(0)] = id;  // General register No. 0, holds the core number
+    cp->cpu.R[REG(1)] = 0;   // General register No. 1
+    cp->cpu.R[REG(2)] = 0;   // General register No. 2
+    cp->cpu.R[REG(3)] = 0;   // General register No. 3
 
     cp->cpu.counter = 0;
     return 0;
@@ -347,9 +1078,10 @@ int computer_load_init(COMPUTER* cp, char* file) {
 
 int print_cpu(COMPUTER* cp) {
     printf(
-        "CPU Registers: SP-%d, PC-%d, IR-0x%x, PSR-0x%x, R[0]-0x%x, "
+        "CPU%d Registers: SP-%d, PC-%d, IR-0x%x, PSR-0x%x, R[0]-0x%x, "
         "R[1]-0x%x, R[2]-0x%x, R[3]-0x%x\n",
-        cp->cpu.SP, cp->cpu.PC, cp->cpu.IR, cp->cpu.PSR, cp->cpu.R[0], cp->cpu.R[1], cp->cpu.R[2], cp->cpu.R[3]);
+        cp->id, cp->cpu.SP, cp->cpu.PC, cp->cpu.IR, cp->cpu.PSR, cp->cpu.R[REG(0)], cp->cpu.R[REG(1)],
+        cp->cpu.R[REG(2)], cp->cpu.R[REG(3)]);
     return 0;
 }
 
@@ -357,7 +1089,7 @@ int print_memory(COMPUTER* cp) {
     // print the memory contents
     int i;
     for (i = 0; i < MAX_MEM_SIZE; i++) {
-        print_instruction(i, cp->memory.addr[i]);
+        print_instruction(i, cp->memory->addr[i]);
     }
     return 0;
 }
@@ -375,3 +1107,919 @@ int print_instruction(int i, uint32_t inst) {
            sec_addr_value, third_addr_value, high_addr_value);
     return 0;
 }
+
+#ifdef CACHE_MODEL
+/*
+Allocate a cache of 'size' words with 'ways' lines per set, backed by 'next'
+(NULL means main memory). Returns NULL if the cache is disabled (size 0).
+*/
+CACHE* cache_create(const char* name, int size, int ways, int latency, CACHE* next) {
+    if (size <= 0)
+        return NULL;
+    if (ways <= 0 || size % (ways * CACHE_LINE_SIZE) != 0) {
+        printf("Error: %s size %d is not a multiple of ways * line size.\n", name, size);
+        exit(-1);
+    }
+    CACHE* c = calloc(1, sizeof(CACHE));
+    c->name = name;
+    c->ways = ways;
+    c->sets = size / (ways * CACHE_LINE_SIZE);
+    c->latency = latency;
+    c->lines = calloc(c->sets * c->ways, sizeof(CACHE_LINE));
+    c->next = next;
+    return c;
+}
+
+/*
+Look up the word at 'addr' and return the number of cycles the access takes.
+Stores are modelled as write-allocate and write-back costs are not counted, so
+loads and stores go through the same path.
+*/
+uint32_t cache_access(CACHE* c, uint32_t addr) {
+    if (c == NULL)
+        return CACHE_MEM_LATENCY;
+
+    uint32_t line = addr / CACHE_LINE_SIZE;
+    uint32_t tag = line / c->sets;
+    CACHE_LINE* set = c->lines + (line % c->sets) * c->ways;
+    c->clock++;
+
+    int i, victim = 0;
+    for (i = 0; i < c->ways; i++) {
+        if (set[i].valid && set[i].tag == tag) {
+            c->hits++;
+            if (CACHE_POLICY == CACHE_LRU)
+                set[i].stamp = c->clock;
+            return c->latency;
+        }
+    }
+
+    // Miss: fill from the next level, prefer an invalid way, otherwise evict
+    c->misses++;
+    uint32_t below = cache_access(c->next, addr);
+    c->miss_cycles += below;
+
+    for (i = 0; i < c->ways && set[i].valid; i++)
+        if (set[i].stamp < set[victim].stamp)
+            victim = i;
+    if (i < c->ways)
+        victim = i;  // an invalid way
+    else if (CACHE_POLICY == CACHE_RANDOM)
+        victim = rand() % c->ways;  // drawn once per eviction
+    set[victim].valid = 1;
+    set[victim].tag = tag;
+    set[victim].stamp = c->clock;
+    return c->latency + below;
+}
+
+int computer_cache_init(COMPUTER* cp) {
+    cp->l2 = cache_create("L2", CACHE_L2_SIZE, CACHE_L2_WAYS, CACHE_L2_LATENCY, NULL);
+    cp->l1i = cache_create("L1I", CACHE_L1I_SIZE, CACHE_L1I_WAYS, CACHE_L1_LATENCY, cp->l2);
+    cp->l1d = cache_create("L1D", CACHE_L1D_SIZE, CACHE_L1D_WAYS, CACHE_L1_LATENCY, cp->l2);
+    cp->stall_cycles = 0;
+    return 0;
+}
+
+int print_cache(CACHE* c) {
+    if (c == NULL)
+        return 0;
+    uint64_t accesses = c->hits + c->misses;
+    printf("%-4s %4d sets x %d ways: accesses %llu, hits %llu, misses %llu, hit rate %.2f%%, miss cycles %llu",
+           c->name, c->sets, c->ways, (unsigned long long) accesses, (unsigned long long) c->hits,
+           (unsigned long long) c->misses, accesses ? 100.0 * c->hits / accesses : 0.0,
+           (unsigned long long) c->miss_cycles);
+    printf(" (avg %.2f)\n", c->misses ? (double) c->miss_cycles / c->misses : 0.0);
+    return 0;
+}
+
+int print_cache_stats(COMPUTER* cp) {
+    static const char* policy[] = {"LRU", "FIFO", "random"};
+    printf("\n--------CACHE STATISTICS (CPU%d)--------\n", cp->id);
+    printf("Line size %d words, %s replacement\n", CACHE_LINE_SIZE, policy[CACHE_POLICY]);
+    print_cache(cp->l1i);
+    print_cache(cp->l1d);
+    print_cache(cp->l2);
+    printf("Instructions %llu, memory stall cycles %llu, cycles per instruction %.2f\n",
+           (unsigned long long) cp->cpu.counter, (unsigned long long) cp->stall_cycles,
+           cp->cpu.counter ? (double) (cp->cpu.counter + cp->stall_cycles) / cp->cpu.counter : 0.0);
+    return 0;
+}
+
+#endif
+
+void stop_on_sigint(int sig) {
+    stop = 1;
+}
+
+/*
+Run a single core to completion (halt, -n limit or Ctrl-C) while recording.
+The run is split into chunks of 'interval' cycles with a checkpoint between
+them, so the per-cycle loop is the same as for a normal run.
+*/
+int record_run(COMPUTER* cp, char* file, uint64_t interval) {
+    static TRACE trace;
+    uint32_t header[6] = {TRACE_MAGIC, TRACE_VERSION, MAX_MEM_SIZE, GP_REGS, TIMER_PERIOD, cp->bus != NULL};
+
+    if ((trace.fp = fopen(file, "wb")) == NULL) {
+        printf("Error: cannot open %s\n", file);
+        exit(-1);
+    }
+    trace.interval = interval;
+    trace.devices = cp->bus != NULL;
+    fwrite(header, sizeof(header), 1, trace.fp);
+    fwrite(&interval, sizeof(interval), 1, trace.fp);
+    cp->trace = &trace;
+
+    while (!stop && cp->cpu.counter < max_cycles) {
+        record_checkpoint(cp);
+        uint64_t left = max_cycles - cp->cpu.counter;
+        if (computer_run(cp, left < interval ? left : interval) != 0)
+            break;
+    }
+    record_checkpoint(cp);  // the end of the recording
+
+    fclose(trace.fp);
+    cp->trace = NULL;
+    fflush(stdout);
+    fprintf(stderr, "\nRecorded %llu cycles to %s\n", (unsigned long long) cp->cpu.counter, file);
+    return 0;
+}
+
+int record_checkpoint(COMPUTER* cp) {
+    uint32_t type = TRACE_CHECKPOINT;
+    fwrite(&type, sizeof(type), 1, cp->trace->fp);
+    fwrite(&cp->cpu, sizeof(CPU), 1, cp->trace->fp);
+    fwrite(cp->memory, sizeof(MEMORY), 1, cp->trace->fp);
+    return 0;
+}
+
+/*
+Called when an interrupt has been taken: PC is the handler and the PSR it
+interrupted is on the stack. Recording logs it; replay checks that the
+recording saw the same interrupt at the same cycle.
+*/
+int trace_interrupt(COMPUTER* cp) {
+    TRACE* t = cp->trace;
+    TRACE_EVENT ev = {cp->cpu.counter, cp->cpu.PC, MEM_LOAD(cp, cp->cpu.SP + 1)};
+
+    if (t->fp != NULL) {
+        uint32_t type = TRACE_INTERRUPT;
+        fwrite(&type, sizeof(type), 1, t->fp);
+        fwrite(&ev, sizeof(ev), 1, t->fp);
+        return 0;
+    }
+
+    TRACE_EVENT* rec = trace_event(t, ev.counter);
+    if (ev.counter <= t->ck[t->n_ck - 1].cpu.counter && (rec == NULL || rec->vector != ev.vector))
+        printf("Warning: replay diverged from the recording, interrupt at cycle %llu\n",
+               (unsigned long long) ev.counter);
+    return 0;
+}
+
+/*
+The recorded interrupt taken at cycle 'counter', NULL if there is none
+*/
+TRACE_EVENT* trace_event(TRACE* t, uint64_t counter) {
+    int lo = 0, hi = t->n_ev;  // events are in cycle order
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t->ev[mid].counter < counter)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < t->n_ev && t->ev[lo].counter == counter) ? &t->ev[lo] : NULL;
+}
+
+/*
+Log a TRACE_READ or TRACE_DMA record of the current cycle
+*/
+int trace_io(COMPUTER* cp, uint32_t type, int32_t addr, int32_t value) {
+    TRACE_IO io = {cp->cpu.counter, addr, value};
+    fwrite(&type, sizeof(type), 1, cp->trace->fp);
+    fwrite(&io, sizeof(io), 1, cp->trace->fp);
+    return 0;
+}
+
+/*
+Index of the first of the 'n' records (in cycle order) at or after 'counter'
+*/
+int trace_find(TRACE_IO* io, int n, uint64_t counter) {
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (io[mid].counter < counter)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+Restore the last checkpoint at or before 'target' and re-execute up to it.
+Returns -1 if the machine halted before reaching 'target'.
+*/
+int replay_seek(COMPUTER* cp, uint64_t target) {
+    TRACE* t = cp->trace;
+    int lo = 0, hi = t->n_ck - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (t->ck[mid].cpu.counter <= target)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    cp->cpu = t->ck[lo].cpu;
+    *cp->memory = t->ck[lo].memory;
+    while (cp->cpu.counter < target)
+        if (cpu_cycle(cp) < 0)
+            return -1;
+    return 0;
+}
+
+/*
+Go back to the last cycle before the current one at which PC == addr, searching
+one checkpoint interval at a time, newest first.
+*/
+int replay_reverse_continue(COMPUTER* cp, uint32_t addr) {
+    TRACE* t = cp->trace;
+    uint64_t limit = cp->cpu.counter, found = UINT64_MAX;
+    int i;
+
+    for (i = t->n_ck - 1; i >= 0 && found == UINT64_MAX; i--) {
+        if (t->ck[i].cpu.counter >= limit)
+            continue;
+        cp->cpu = t->ck[i].cpu;
+        *cp->memory = t->ck[i].memory;
+        while (cp->cpu.counter < limit) {
+            if (cp->cpu.PC == addr)
+                found = cp->cpu.counter;
+            if (cpu_cycle(cp) < 0)
+                break;
+        }
+        limit = t->ck[i].cpu.counter;
+    }
+    if (found == UINT64_MAX) {
+        replay_seek(cp, 0);
+        return -1;
+    }
+    return replay_seek(cp, found);
+}
+
+/*
+Interactive replay of a recording made with -r. Commands are read from stdin.
+*/
+int replay(char* file) {
+    static MEMORY memory;
+    static COMPUTER comp;
+    static TRACE trace;
+    FILE* fp = fopen(file, "rb");
+    uint32_t header[6], type;
+    int cap_ck = 0, cap_ev = 0, cap_rd = 0, cap_dma = 0;
+
+    if (fp == NULL || fread(header, sizeof(header), 1, fp) != 1 || header[0] != TRACE_MAGIC ||
+        header[1] != TRACE_VERSION || fread(&trace.interval, sizeof(trace.interval), 1, fp) != 1) {
+        printf("Error: %s is not a recording\n", file);
+        exit(-1);
+    }
+    // Checkpoints of another machine have another layout, and it would run differently
+    if (header[2] != MAX_MEM_SIZE || header[3] != GP_REGS || header[4] != TIMER_PERIOD) {
+        printf("Error: %s was recorded on another machine (%u words, %u registers, timer every %u cycles)\n", file,
+               header[2], header[3], header[4]);
+        exit(-1);
+    }
+    trace.devices = header[5];
+    while (fread(&type, sizeof(type), 1, fp) == 1) {
+        if (type == TRACE_CHECKPOINT) {
+            if (trace.n_ck == cap_ck)
+                trace.ck = realloc(trace.ck, (cap_ck = cap_ck * 2 + 16) * sizeof(CHECKPOINT));
+            if (fread(&trace.ck[trace.n_ck].cpu, sizeof(CPU), 1, fp) != 1 ||
+                fread(&trace.ck[trace.n_ck].memory, sizeof(MEMORY), 1, fp) != 1)
+                break;
+            trace.n_ck++;
+        } else if (type == TRACE_INTERRUPT) {
+            if (trace.n_ev == cap_ev)
+                trace.ev = realloc(trace.ev, (cap_ev = cap_ev * 2 + 16) * sizeof(TRACE_EVENT));
+            if (fread(&trace.ev[trace.n_ev], sizeof(TRACE_EVENT), 1, fp) != 1)
+                break;
+            trace.n_ev++;
+        } else if (type == TRACE_READ) {
+            if (trace.n_rd == cap_rd)
+                trace.rd = realloc(trace.rd, (cap_rd = cap_rd * 2 + 16) * sizeof(TRACE_IO));
+            if (fread(&trace.rd[trace.n_rd], sizeof(TRACE_IO), 1, fp) != 1)
+                break;
+            trace.n_rd++;
+        } else if (type == TRACE_DMA) {
+            if (trace.n_dma == cap_dma)
+                trace.dma = realloc(trace.dma, (cap_dma = cap_dma * 2 + 16) * sizeof(TRACE_IO));
+            if (fread(&trace.dma[trace.n_dma], sizeof(TRACE_IO), 1, fp) != 1)
+                break;
+            trace.n_dma++;
+        } else
+            break;
+    }
+    fclose(fp);
+    if (trace.n_ck == 0) {
+        printf("Error: %s has no checkpoint\n", file);
+        exit(-1);
+    }
+
+    comp.memory = &memory;
+    comp.trace = &trace;
+    comp.quiet = 1;
+    uint64_t end = trace.ck[trace.n_ck - 1].cpu.counter;
+    printf("Recording: %llu cycles, %d checkpoints every %llu cycles, %d interrupts", (unsigned long long) end,
+           trace.n_ck, (unsigned long long) trace.interval, trace.n_ev);
+    if (trace.devices)
+        printf(", %d device reads, %d words transferred", trace.n_rd, trace.n_dma);
+    printf("\n");
+    printf("Commands: seek N, step [n], rstep [n], cont ADDR, rcont ADDR, regs, mem, quit\n");
+    replay_seek(&comp, 0);
+
+    char line[128], cmd[16];
+    unsigned long long arg;
+    while (1) {
+        printf("(replay %llu) ", (unsigned long long) comp.cpu.counter);
+        fflush(stdout);
+        if (fgets(line, sizeof(line), stdin) == NULL)
+            break;
+        int n = sscanf(line, "%15s %llu", cmd, &arg);
+        if (n < 1)
+            continue;
+        uint64_t now = comp.cpu.counter;
+        int halted = 0;
+
+        // Past the last checkpoint nothing recorded drives the machine, so forward moves stop there
+        uint64_t target = !strcmp(cmd, "seek") ? arg : now + (n == 2 ? arg : 1);
+        if (((!strcmp(cmd, "seek") && n == 2) || !strcmp(cmd, "step")) && target > end) {
+            printf("The recording ends at cycle %llu\n", (unsigned long long) end);
+            target = end;
+        }
+
+        if (!strcmp(cmd, "quit"))
+            break;
+        else if (!strcmp(cmd, "seek") && n == 2)
+            halted = replay_seek(&comp, target);
+        else if (!strcmp(cmd, "step"))
+            halted = replay_seek(&comp, target);
+        else if (!strcmp(cmd, "rstep"))
+            replay_seek(&comp, now > (n == 2 ? arg : 1) ? now - (n == 2 ? arg : 1) : 0);
+        else if (!strcmp(cmd, "cont") && n == 2 && now >= end)
+            printf("The recording ends at cycle %llu\n", (unsigned long long) end);
+        else if (!strcmp(cmd, "cont") && n == 2) {
+            // run forward until PC == ADDR, at most to the end of the recording
+            do {
+                if (cpu_cycle(&comp) < 0) {
+                    halted = -1;
+                    break;
+                }
+            } while (comp.cpu.PC != arg && comp.cpu.counter < end);
+        } else if (!strcmp(cmd, "rcont") && n == 2) {
+            if (replay_reverse_continue(&comp, arg) < 0)
+                printf("PC %llu not reached before cycle %llu\n", arg, (unsigned long long) now);
+        } else if (!strcmp(cmd, "regs"))
+            ;
+        else if (!strcmp(cmd, "mem")) {
+            print_memory(&comp);
+            continue;
+        } else {
+            printf("Unknown command\n");
+            continue;
+        }
+        if (halted < 0)
+            printf("The machine halted at cycle %llu\n", (unsigned long long) comp.cpu.counter);
+        print_cpu(&comp);
+    }
+    return 0;
+}
+
+/*
+Add a breakpoint (WATCH_EXEC) or watchpoint (WATCH_READ/WATCH_WRITE) on 'addr',
+or a combination of them.
+cond_reg is a register number, 0 to GP_REGS-1 or 64 for SP, or -1 to make it
+unconditional. Returns its index, or -1 if invalid.
+*/
+int debug_watch(DEBUGGER* d, int type, uint32_t addr, int cond_reg, char cond_op, int32_t cond_value) {
+    if (d->n_watch == MAX_WATCHES || type <= 0 || type > (WATCH_EXEC | WATCH_READ | WATCH_WRITE) ||
+        addr >= MAX_MEM_SIZE || cond_reg < -1 || (cond_reg >= GP_REGS && cond_reg != 64))
+        return -1;
+    WATCH* w = &d->watch[d->n_watch];
+    w->type = type;
+    w->addr = addr;
+    w->cond_reg = cond_reg;
+    w->cond_op = cond_op;
+    w->cond_value = cond_value;
+    w->hits = 0;
+    d->flags[addr] |= type;
+    return d->n_watch++;
+}
+
+/*
+Parse "addr" or "addr:Rn<op>value" (op is <, =, > or !=; sp is R64)
+*/
+int debug_watch_parse(DEBUGGER* d, int type, char* spec) {
+    char* p;
+    uint32_t addr = strtoul(spec, &p, 10);
+    int reg = -1;
+    char op = 0;
+    int32_t value = 0;
+
+    if (p == spec)
+        return -1;
+    if (*p == ':') {
+        p++;
+        if (p[0] == 's' && p[1] == 'p') {
+            reg = 64;
+            p += 2;
+        } else if (p[0] == 'R' && isdigit((unsigned char) p[1])) {
+            reg = strtol(p + 1, &p, 10);
+            if (reg >= GP_REGS)
+                return -1;
+        } else
+            return -1;
+        op = *p++;
+        if (op == '!' && *p++ != '=')
+            return -1;
+        if (op != '<' && op != '=' && op != '>' && op != '!')
+            return -1;
+        value = strtol(p, &p, 10);
+    }
+    if (*p != '\0')
+        return -1;
+    return debug_watch(d, type, addr, reg, op, value);
+}
+
+int debug_unwatch(DEBUGGER* d, int index) {
+    if (index < 0 || index >= d->n_watch)
+        return -1;
+    d->watch[index] = d->watch[--d->n_watch];
+    // rebuild the flags, other watches may still cover the same word
+    memset(d->flags, 0, sizeof(d->flags));
+    for (int i = 0; i < d->n_watch; i++)
+        d->flags[d->watch[i].addr] |= d->watch[i].type;
+    return 0;
+}
+
+/*
+Note an access to a watched word in the current cycle
+*/
+int debug_access(COMPUTER* cp, uint32_t addr, int type) {
+    if (IS_IO(addr))
+        return 0;
+    addr = MEM_ADDR(addr);
+    if (addr < MAX_MEM_SIZE && cp->debugger->flags[addr] & type && cp->n_access < 8)
+        cp->access[cp->n_access++] = addr | (type << 24);
+    return 0;
+}
+
+/*
+Flags of the memory word at 'a', 0 for the device window and addresses
+outside the memory
+*/
+#define WATCH_FLAGS(flags, a) \
+    (!IS_IO(a) && MEM_ADDR((uint32_t) (a)) < MAX_MEM_SIZE ? (flags)[MEM_ADDR((uint32_t) (a))] : 0)
+
+/*
+Flags of the instruction at PC, not fetched yet, and of the words it loads or
+stores; computer_run() hands the cycle to computer_run_instrumented() if
+any is set
+*/
+int debug_watched(COMPUTER* cp, uint8_t* flags) {
+    uint32_t pc = MEM_ADDR(cp->cpu.PC), instr;
+
+    if (pc >= MAX_MEM_SIZE)
+        return 0;  // the fetch fails in computer_run() as well
+    instr = MEM_LOAD(cp, pc);  // fields as decode() splits them, without its error message
+    switch (instr >> 24) {
+    case OP_LW:
+    case OP_SW:
+    case OP_XCHG:
+        if (!REG_VALID((instr >> 16) & 0xff))
+            return flags[pc];
+        return flags[pc] | WATCH_FLAGS(flags, cp->cpu.R[REG((instr >> 16) & 0xff)] + (int8_t) instr);
+    case OP_PUSH:
+        return flags[pc] | WATCH_FLAGS(flags, cp->cpu.SP - 1);
+    case OP_POP:
+    case OP_IRET:
+        return flags[pc] | WATCH_FLAGS(flags, cp->cpu.SP) | WATCH_FLAGS(flags, cp->cpu.SP + 1);
+    }
+    return flags[pc];
+}
+
+/*
+Count a hit on every watch of 'addr' that includes 'type' (one WATCH_* bit)
+and report the first one whose condition holds. 'old' is the value before the
+access, NULL if unknown.
+Returns 1 if the run should stop.
+*/
+int debug_trigger(COMPUTER* cp, uint32_t addr, int type, uint32_t* old) {
+    DEBUGGER* d = cp->debugger;
+    int i, stop_here = 0;
+    for (i = 0; i < d->n_watch; i++) {
+        WATCH* w = &d->watch[i];
+        if (w->addr != addr || !(w->type & type))
+            continue;
+        __atomic_add_fetch(&w->hits, 1, __ATOMIC_RELAXED);
+        if (stop_here)
+            continue;
+        if (w->cond_reg >= 0) {
+            int32_t r = cp->cpu.R[REG(w->cond_reg)];
+            if (!((w->cond_op == '<' && r < w->cond_value) || (w->cond_op == '=' && r == w->cond_value) ||
+                  (w->cond_op == '>' && r > w->cond_value) || (w->cond_op == '!' && r != w->cond_value)))
+                continue;
+        }
+        stop_here = 1;
+        if (type == WATCH_EXEC)
+            printf("\nCPU%d: breakpoint %d at PC %u, cycle %llu\n", cp->id, i, addr,
+                   (unsigned long long) cp->cpu.counter);
+        else {
+            printf("\nCPU%d: watchpoint %d, %s of mem[%u] (", cp->id, i, type == WATCH_READ ? "read" : "write", addr);
+            if (old != NULL && *old != MEM_LOAD(cp, addr))
+                printf("0x%x -> ", *old);
+            printf("0x%x), cycle %llu\n", MEM_LOAD(cp, addr), (unsigned long long) cp->cpu.counter);
+        }
+        print_cpu(cp);
+    }
+    return stop_here;
+}
+
+/*
+The run loop with breakpoint and watchpoint checks, and coverage if it is
+recorded. computer_run() hands it single cycles that reach a flagged word.
+Before each cycle it decodes the instruction at PC to note the watched words
+the instruction will touch and their values, for the report of a write.
+*/
+int computer_run_instrumented(COMPUTER* cp, uint64_t cycles) {
+    DEBUGGER* d = cp->debugger;
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    uint32_t old[8];
+    int i, n_before, hit;
+
+    while (cycles--) {
+        uint32_t pc = MEM_ADDR(cp->cpu.PC);
+        if (stop)
+            return 1;
+        if (pc >= MAX_MEM_SIZE) {
+            if (cpu_cycle(cp) < 0)
+                return -1;
+            continue;
+        }
+        if (decode(MEM_LOAD(cp, pc), &opcode, &sreg, &treg, &imm) < 0)
+            return -1;
+
+        if (cp->coverage) {
+            COVERAGE_MARK(&cp->coverage[pc], COV_EXEC);
+            if (opcode == OP_BLEZ)
+                COVERAGE_MARK(&cp->coverage[pc], cp->cpu.R[sreg] <= 0 ? COV_TAKEN : COV_NOT_TAKEN);
+        }
+        if (d->flags[pc] & WATCH_EXEC && !cp->resume && debug_trigger(cp, pc, WATCH_EXEC, 0)) {
+            cp->resume = 1;
+            return 1;
+        }
+        cp->resume = 0;
+
+        // Words the instruction will read or write, same address arithmetic as execute()
+        cp->n_access = 0;
+        switch (opcode) {
+        case OP_LW:
+            debug_access(cp, cp->cpu.R[sreg] + imm, WATCH_READ);
+            break;
+        case OP_SW:
+            debug_access(cp, cp->cpu.R[sreg] + imm, WATCH_WRITE);
+            break;
+        case OP_XCHG:
+            debug_access(cp, cp->cpu.R[sreg] + imm, WATCH_READ);
+            debug_access(cp, cp->cpu.R[sreg] + imm, WATCH_WRITE);
+            break;
+        case OP_PUSH:
+            debug_access(cp, cp->cpu.SP - 1, WATCH_WRITE);
+            break;
+        case OP_POP:
+            debug_access(cp, cp->cpu.SP, WATCH_READ);
+            break;
+        case OP_IRET:
+            debug_access(cp, cp->cpu.SP, WATCH_READ);
+            debug_access(cp, cp->cpu.SP + 1, WATCH_READ);
+            break;
+        }
+        n_before = cp->n_access;
+        for (i = 0; i < n_before; i++)
+            old[i] = MEM_LOAD(cp, cp->access[i] & 0xffffff);
+
+        if (cpu_cycle(cp) < 0)
+            return -1;
+
+        // check_interrupt() may have added the words of an interrupt entry
+        for (hit = 0, i = 0; i < cp->n_access; i++)
+            hit |= debug_trigger(cp, cp->access[i] & 0xffffff, cp->access[i] >> 24, i < n_before ? &old[i] : NULL);
+        if (hit)
+            return 1;
+    }
+    return 0;
+}
+
+int print_watches(DEBUGGER* d) {
+    static const char* kind[8] = {"", "break", "read", "break+read", "write", "break+write", "read+write", "all"};
+    int i;
+    printf("\n--------BREAKPOINTS AND WATCHPOINTS--------\n");
+    for (i = 0; i < d->n_watch; i++) {
+        WATCH* w = &d->watch[i];
+        printf("%d: %-5s %u", i, kind[w->type], w->addr);
+        if (w->cond_reg == 64)
+            printf(" if sp %c%s %d", w->cond_op, w->cond_op == '!' ? "=" : "", w->cond_value);
+        else if (w->cond_reg >= 0)
+            printf(" if R%d %c%s %d", w->cond_reg, w->cond_op, w->cond_op == '!' ? "=" : "", w->cond_value);
+        printf(", hits %llu\n", (unsigned long long) w->hits);
+    }
+    return 0;
+}
+
+/*
+Attach the devices: console input read from 'input' ("-" for stdin) and a
+block device backed by 'disk', either of which may be NULL. Returns -1 (after
+printing why) if a file cannot be used.
+*/
+int bus_init(BUS* b, char* input, char* disk) {
+    static RING ring;
+    pthread_t thread;
+    struct stat st;
+
+    memset(b, 0, sizeof(*b));
+    b->enable = 1 << IRQ_TIMER;
+    if (input != NULL) {
+        b->input_fd = strcmp(input, "-") ? open(input, O_RDONLY) : 0;
+        if (b->input_fd < 0) {
+            printf("Error: cannot open %s\n", input);
+            return -1;
+        }
+        b->input = &ring;
+        if (pthread_create(&thread, NULL, console_thread, b) != 0) {
+            printf("Error: pthread_create()\n");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    if (disk != NULL) {
+        int fd = open(disk, O_RDWR);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            printf("Error: cannot open %s\n", disk);
+            return -1;
+        }
+        if (st.st_size == 0 || st.st_size % (BLOCK_WORDS * 4) != 0) {
+            printf("Error: the size of %s is not a multiple of %d bytes\n", disk, BLOCK_WORDS * 4);
+            return -1;
+        }
+        b->disk = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (b->disk == MAP_FAILED) {
+            printf("Error: cannot map %s\n", disk);
+            return -1;
+        }
+        b->disk_size = st.st_size;
+        b->disk_blocks = st.st_size / (BLOCK_WORDS * 4);
+    }
+    return 0;
+}
+
+/*
+Detach the devices at the end of the run: the block device is written back
+to its file before it is unmapped. Returns -1 (after printing why) if that
+failed.
+*/
+int bus_close(BUS* b) {
+    int ret = 0;
+    if (b->disk != NULL) {
+        if (msync(b->disk, b->disk_size, MS_SYNC) < 0) {
+            printf("Error: cannot write back the block device: %s\n", strerror(errno));
+            ret = -1;
+        }
+        munmap(b->disk, b->disk_size);
+        b->disk = NULL;
+    }
+    return ret;
+}
+
+/*
+A load from the device window. A recording logs the value, and its replay
+returns the logged value instead
+*/
+int32_t bus_read(COMPUTER* cp, int32_t addr) {
+    if (REPLAY_DEVICES(cp)) {
+        TRACE* t = cp->trace;
+        int i = trace_find(t->rd, t->n_rd, cp->cpu.counter);
+        if (i < t->n_rd && t->rd[i].counter == cp->cpu.counter && t->rd[i].addr == addr)
+            return t->rd[i].value;
+        printf("Warning: replay diverged from the recording, device read at cycle %llu\n",
+               (unsigned long long) cp->cpu.counter);
+        return 0;
+    }
+    int32_t value = bus_register(cp, addr);
+    if (cp->trace != NULL && cp->trace->fp != NULL && cp->bus != NULL)
+        trace_io(cp, TRACE_READ, addr, value);
+    return value;
+}
+
+/*
+The value of a device register
+*/
+int32_t bus_register(COMPUTER* cp, int32_t addr) {
+    BUS* b = cp->bus;
+    if (b == NULL)
+        return 0;
+    if (addr >= IO_INTC_VECTOR && addr < IO_INTC_VECTOR + N_IRQ)
+        return b->vector[addr - IO_INTC_VECTOR];
+
+    switch (addr) {
+    case IO_INTC_PENDING:
+        console_waiting(b);  // look at the producer now, not at the next poll
+        return bus_lines(cp);
+    case IO_INTC_ENABLE:
+        return b->enable;
+    case IO_INTC_CURRENT:
+        return b->current;
+    case IO_CON_STATUS:
+        return console_waiting(b);
+    case IO_CON_DATA:
+        return b->input ? ring_read(b->input) : -1;
+    case IO_CON_CTRL:
+        return b->con_ctrl;
+    case IO_BLK_BLOCK:
+        return b->blk_block;
+    case IO_BLK_ADDR:
+        return b->blk_addr;
+    case IO_BLK_COUNT:
+        return b->blk_count;
+    case IO_BLK_CMD:
+        return b->blk_state;
+    case IO_BLK_SIZE:
+        return b->disk_blocks;
+    }
+    return 0;
+}
+
+/*
+A store to the device window. In the replay of a recording with devices a
+store that started a transfer copies the words the recording logged
+*/
+int bus_write(COMPUTER* cp, int32_t addr, int32_t value) {
+    BUS* b = cp->bus;
+    if (REPLAY_DEVICES(cp)) {
+        TRACE* t = cp->trace;
+        int i;
+        for (i = trace_find(t->dma, t->n_dma, cp->cpu.counter); i < t->n_dma && t->dma[i].counter == cp->cpu.counter;
+             i++)
+            MEM_STORE(cp, t->dma[i].addr, t->dma[i].value);
+        return 0;
+    }
+    if (b == NULL)
+        return 0;
+    if (addr >= IO_INTC_VECTOR && addr < IO_INTC_VECTOR + N_IRQ) {
+        b->vector[addr - IO_INTC_VECTOR] = value;
+        return 0;
+    }
+
+    switch (addr) {
+    case IO_INTC_ENABLE:
+        b->enable = value;
+        break;
+    case IO_CON_CTRL:
+        b->con_ctrl = value & 1;
+        break;
+    case IO_BLK_BLOCK:
+        b->blk_block = value;
+        break;
+    case IO_BLK_ADDR:
+        b->blk_addr = value;
+        break;
+    case IO_BLK_COUNT:
+        b->blk_count = value;
+        break;
+    case IO_BLK_CMD:
+        if (value == BLK_READ || value == BLK_WRITE)
+            block_transfer(cp, value);
+        else if (value == BLK_IDLE)
+            b->blk_state = BLK_IDLE;
+        break;
+    }
+    return 0;
+}
+
+/*
+The lines raised right now, bit n for IRQ n
+*/
+uint32_t bus_lines(COMPUTER* cp) {
+    BUS* b = cp->bus;
+    uint32_t lines = 0;
+    if (b->timer)
+        lines |= 1 << IRQ_TIMER;
+    if (b->con_ctrl && console_line(b))
+        lines |= 1 << IRQ_CONSOLE;
+    if (b->blk_state == BLK_DONE || b->blk_state == BLK_ERROR)
+        lines |= 1 << IRQ_BLOCK;
+    return lines;
+}
+
+/*
+Bytes of console input waiting, -1 once the input has ended and was all read
+(and always without console input). Remembers what it saw for console_line().
+*/
+int32_t console_waiting(BUS* b) {
+    if (b->input == NULL)
+        return -1;
+    // the producer sets eof after its last write, so with eof seen first the count is final
+    b->con_eof = __atomic_load_n(&b->input->eof, __ATOMIC_ACQUIRE);
+    b->con_head = __atomic_load_n(&b->input->head, __ATOMIC_ACQUIRE);
+    uint32_t n = b->con_head - b->input->tail;
+    return (n == 0 && b->con_eof) ? -1 : (int32_t) n;
+}
+
+/*
+IRQ_CONSOLE is raised while bytes are waiting or once the input has ended.
+The line is checked in every cycle, but the producer's index, which the host
+thread keeps writing, is only loaded again once the bytes seen last time have
+been read, and then every CON_POLL cycles; the core's own tail is not shared
+with another writer.
+*/
+int console_line(BUS* b) {
+    if (b->input == NULL || b->con_eof || b->con_head != b->input->tail)
+        return 1;
+    if (--b->con_poll > 0)
+        return 0;
+    b->con_poll = CON_POLL;
+    return console_waiting(b) != 0;
+}
+
+/*
+DMA transfer of IO_BLK_COUNT words between the block device, starting at
+block IO_BLK_BLOCK, and memory at IO_BLK_ADDR. The words are copied at once,
+without taking any cycle of the core, and the transfer ends in BLK_DONE, or
+in BLK_ERROR (nothing copied) if it does not fit the device or the memory;
+either way IRQ_BLOCK is raised until the guest acknowledges it.
+*/
+int block_transfer(COMPUTER* cp, int cmd) {
+    BUS* b = cp->bus;
+    uint64_t first = (uint64_t) (uint32_t) b->blk_block * BLOCK_WORDS;
+
+    if (b->disk == NULL || b->blk_block < 0 || b->blk_addr < 0 || b->blk_count < 0 ||
+        (uint64_t) b->blk_addr + b->blk_count > MAX_MEM_SIZE ||
+        first + b->blk_count > (uint64_t) b->disk_blocks * BLOCK_WORDS) {
+        b->blk_state = BLK_ERROR;
+        return -1;
+    }
+    if (cmd == BLK_READ) {
+        memcpy(&cp->memory->addr[b->blk_addr], &b->disk[first], b->blk_count * 4);
+        for (int i = 0; cp->trace != NULL && cp->trace->fp != NULL && i < b->blk_count; i++)
+            trace_io(cp, TRACE_DMA, b->blk_addr + i, cp->memory->addr[b->blk_addr + i]);
+    } else
+        memcpy(&b->disk[first], &cp->memory->addr[b->blk_addr], b->blk_count * 4);
+    b->blk_state = BLK_DONE;
+    return 0;
+}
+
+/*
+Host thread of the console input: copies the input into the ring, waiting
+while the ring is full, then marks the end of the input
+*/
+void* console_thread(void* arg) {
+    BUS* b = (BUS*) arg;
+    uint8_t chunk[4096];
+    ssize_t n;
+
+    while ((n = read(b->input_fd, chunk, sizeof(chunk))) > 0) {
+        uint32_t done = ring_write(b->input, chunk, n);
+        while (done < n) {
+            poll(NULL, 0, 1);  // full, let the guest catch up
+            done += ring_write(b->input, chunk + done, n - done);
+        }
+    }
+    __atomic_store_n(&b->input->eof, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+Producer side: append up to 'n' bytes, returns how many fitted
+*/
+uint32_t ring_write(RING* r, const uint8_t* p, uint32_t n) {
+    uint32_t head = r->head, i;
+    uint32_t room = RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    if (n > room)
+        n = room;
+    for (i = 0; i < n; i++)
+        r->buf[(head + i) & (RING_SIZE - 1)] = p[i];
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);  // publishes the bytes
+    return n;
+}
+
+/*
+Consumer side: the next byte, -1 if the ring is empty
+*/
+int ring_read(RING* r) {
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+        return -1;
+    int c = r->buf[tail & (RING_SIZE - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);  // gives the slot back to the producer
+    return c;
+}
@@ -0,0 +1,460 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+
+#define MAX_MEM_SIZE 128  // The max memory size - (unit: word - 32 bits), must match the simulator
+#define TIMER_PERIOD 5000  // A timer interrupt is raised every TIMER_PERIOD cycles
+#define IO_BASE 0xffffff80u  // first word of the device window, must match the simulator
+
+enum {
+    OP_HALT = 0x00,
+    OP_NOP = 0x01,
+    OP_ADDI = 0x02,
+    OP_MOVEREG = 0x03,
+    OP_MOVEI = 0x04,
+    OP_LW = 0x05,
+    OP_SW = 0x06,
+    OP_BLEZ = 0x07,
+    OP_LA = 0x08,
+    OP_PUSH = 0x09,
+    OP_POP = 0x0a,
+    OP_ADD = 0x0b,
+    OP_JMP = 0x0c,
+    OP_IRET = 0x10,
+    OP_PUT = 0x11,
+    OP_XCHG = 0x12,
+    OP_NONE = 0xff,
+};
+
+/*
+Ahead-of-time translator: turns a .code image into a C program that behaves
+exactly like running the image on icpu from the given initial PC.
+
+Every block leader (entry point, branch/jump targets, fall-through after a
+branch, and addresses loaded with 'la', which is how the sample programs build
+ISR and return addresses) gets a label. A block checks once on entry whether
+the timer can fire before it ends; if not, the whole block runs inline with a
+single counter update, otherwise the generated program single-steps through a
+copy of the interpreter loop until it is past the timer tick. Computed targets
+(iret, interrupt entry, jumps outside the image) go through a switch on PC, and
+any PC that is not a leader falls back to the same single-step loop.
+
+The translation is made from the image as loaded, so programs that overwrite
+their own instructions are not supported (data words can be changed freely).
+There are no devices: lw/sw/xchg in the device window behave as on icpu
+without -i/-d, reads return 0 and writes are ignored.
+
+With -C the generated program records coverage in the layout icpu -C uses. A
+block only sets one flag when it runs; the flags are expanded to the bits of
+every instruction in the block when the program exits, so straight-line code
+costs a single store per block. Each blez direction stores its own bit, and
+the single-step loop marks every instruction it executes. SIGINT stops the
+program at the next single step (at the latest at the next timer tick) so
+that long-running programs can still write their coverage.
+*/
+
+int coverage = 0;  // -C: the generated program collects coverage (see coverage.h)
+int dump = 0;      // -d: the generated program prints the machine state to stderr when it halts
+uint32_t image_hash;
+
+int load_image(char*, uint32_t*, uint32_t*);
+void decode(uint32_t, uint8_t*, uint8_t*, uint8_t*, int8_t*);
+int is_terminator(uint8_t);
+void find_leaders(uint32_t*, int, uint32_t, uint8_t*);
+void emit_prologue(FILE*, uint32_t*, uint32_t);
+void emit_block(FILE*, uint32_t*, int, uint8_t*, int);
+void emit_instruction(FILE*, uint32_t, int, uint8_t*);
+void emit_target(FILE*, int, uint8_t*);
+void emit_epilogue(FILE*, uint32_t*, int, uint8_t*);
+int block_end(uint32_t*, int, uint8_t*, int);
+
+int main(int argc, char** args) {
+    while (argc > 1 && (!strcmp(args[1], "-C") || !strcmp(args[1], "-d"))) {
+        if (args[1][1] == 'C')
+            coverage = 1;
+        else
+            dump = 1;
+        args++, argc--;
+    }
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s [-C] [-d] image.code output.c [16]\n", args[0]);
+        printf("\t image.code: the program image; output.c: generated C source; 16: the initial PC\n");
+        printf("\t -C: the generated program takes a coverage file argument and merges its coverage into it\n");
+        printf("\t -d: the generated program prints PC, PSR, counter, registers and memory to stderr at halt\n");
+        exit(-1);
+    }
+
+    uint32_t mem[MAX_MEM_SIZE];
+    uint32_t entry = MAX_MEM_SIZE;  // left untouched by a legacy image
+    int size = load_image(args[1], mem, &entry);
+    image_hash = image_checksum((uint8_t*) mem, sizeof(mem));
+
+    if (argc == 4)
+        entry = atoi(args[3]);
+    else if (entry == MAX_MEM_SIZE) {
+        printf("Error: a legacy image has no entry point, give the initial PC.\n");
+        exit(-1);
+    }
+    if (entry >= MAX_MEM_SIZE) {
+        printf("Error: start_addr should be in 0-%d.\n", MAX_MEM_SIZE - 1);
+        exit(-1);
+    }
+
+    uint8_t leader[MAX_MEM_SIZE];
+    find_leaders(mem, size, entry, leader);
+
+    FILE* fp_out = fopen(args[2], "w");
+    if (fp_out == NULL) {
+        printf("Error: fopen() %s: %s\n", args[2], strerror(errno));
+        exit(-1);
+    }
+    emit_prologue(fp_out, mem, entry);
+    for (int i = 0; i < size; i++)
+        if (leader[i])
+            emit_block(fp_out, mem, size, leader, i);
+    emit_epilogue(fp_out, mem, size, leader);
+    fclose(fp_out);
+
+    return 0;
+}
+
+/*
+Load the image the same way computer_load_init() does. Returns the number of
+words up to the last non-zero one; everything past it is zero (halt).
+*/
+int load_image(char* file, uint32_t* mem, uint32_t* p_entry) {
+    int size, ret = image_load(file, mem, MAX_MEM_SIZE, p_entry);
+    if (ret < 0)
+        exit(-1);
+    for (size = MAX_MEM_SIZE; size > 0 && mem[size - 1] == 0; size--)
+        ;
+    return size;
+}
+
+void decode(uint32_t instr, uint8_t* p_opcode, uint8_t* p_sreg, uint8_t* p_treg, int8_t* p_imm) {
+    *p_opcode = instr >> 24;
+    *p_sreg = instr >> 16;
+    *p_treg = instr >> 8;
+    *p_imm = (int8_t) instr;
+}
+
+/*
+Instructions after which execution does not simply continue with PC + 1
+*/
+int is_terminator(uint8_t opcode) {
+    switch (opcode) {
+    case OP_NOP:  // nop does not advance PC in the simulator, it spins in place
+    case OP_BLEZ:
+    case OP_JMP:
+    case OP_IRET:
+    case OP_HALT:
+        return 1;
+    case OP_ADDI:
+    case OP_MOVEREG:
+    case OP_MOVEI:
+    case OP_LW:
+    case OP_SW:
+    case OP_LA:
+    case OP_PUSH:
+    case OP_POP:
+    case OP_ADD:
+    case OP_PUT:
+    case OP_XCHG:
+        return 0;
+    default:
+        return 1;  // invalid opcode, reported by the single-step loop
+    }
+}
+
+void find_leaders(uint32_t* mem, int size, uint32_t entry, uint8_t* leader) {
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    int i, target;
+
+    memset(leader, 0, MAX_MEM_SIZE);
+    if (entry < size)
+        leader[entry] = 1;
+    for (i = 0; i < size; i++) {
+        decode(mem[i], &opcode, &sreg, &treg, &imm);
+        target = i + 1 + imm;
+        switch (opcode) {
+        case OP_NOP:
+            leader[i] = 1;
+            break;
+        case OP_BLEZ:
+        case OP_JMP:
+        case OP_LA:
+            if (target >= 0 && target < size)
+                leader[target] = 1;
+            break;
+        }
+        if (is_terminator(opcode) && i + 1 < size)
+            leader[i + 1] = 1;
+    }
+}
+
+void emit_prologue(FILE* fp, uint32_t* mem, uint32_t entry) {
+    fprintf(fp, "/* Generated by translator.c - do not edit */\n");
+    if (coverage)
+        fprintf(fp, "#define _POSIX_C_SOURCE 200809L  // ftruncate() in coverage.h\n#include <signal.h>\n");
+    fprintf(fp, "#include <stdint.h>\n#include <stdio.h>\n\n");
+    if (coverage)
+        fprintf(fp, "#include \"coverage.h\"\n\n");
+    fprintf(fp, "#define MAX_MEM_SIZE %d\n#define TIMER_PERIOD %d\n", MAX_MEM_SIZE, TIMER_PERIOD);
+    fprintf(fp, "#define PSR_INT_EN 0x1\n#define PSR_INT_PEND 0x2\n#define SP R[64]\n\n");
+    // lw/sw/xchg in the device window act as on icpu without devices: reads return 0, writes are ignored
+    fprintf(fp, "#define IO_BASE 0x%08xu\n", IO_BASE);
+    fprintf(fp, "#define LOAD(a) ((uint32_t) (a) >= IO_BASE ? 0 : mem[a])\n");
+    fprintf(fp, "#define STORE(a, v) do { if ((uint32_t) (a) < IO_BASE) mem[a] = (v); } while (0)\n\n");
+
+    fprintf(fp, "static uint32_t mem[MAX_MEM_SIZE] = {");
+    for (int i = 0; i < MAX_MEM_SIZE; i++)
+        fprintf(fp, "%s0x%08xu,", (i % 8) ? " " : "\n    ", mem[i]);
+    fprintf(fp, "\n};\n\n");
+
+    if (coverage) {
+        fprintf(fp, "static uint8_t cov[MAX_MEM_SIZE], block_hit[MAX_MEM_SIZE];\n");
+        fprintf(fp, "static volatile sig_atomic_t stop = 0;\n\n");
+        fprintf(fp, "static void stop_on_sigint(int sig) {\n    stop = 1;\n}\n\n");
+        fprintf(fp, "int main(int argc, char** args) {\n");
+        fprintf(fp, "    if (argc != 2) {\n        printf(\"Usage: %%s coverage_file\\n\", args[0]);\n");
+        fprintf(fp, "        return -1;\n    }\n");
+        fprintf(fp, "    signal(SIGINT, stop_on_sigint);\n");
+    } else
+        fprintf(fp, "int main(void) {\n");
+    fprintf(fp, "    int32_t R[65] = {0};\n");
+    fprintf(fp, "    uint32_t PC = %u, PSR = PSR_INT_EN, IR;\n", entry);
+    fprintf(fp, "    uint64_t counter = 0, deadline = TIMER_PERIOD;  // deadline: next timer tick\n");
+    fprintf(fp, "    uint8_t opcode, sreg, treg;\n    int8_t imm;\n\n");
+    fprintf(fp,
+            "    printf(\n"
+            "        \"----------------------------------------------------------------\\n|\"\n"
+            "        \"           Simple von Neumann Computer for CENG 5401          |\\n| \"\n"
+            "        \"            Tianyi YANG (tyyang@cse.cuhk.edu.hk)             \"\n"
+            "        \"|\\n----------------------------------------------------------------\"\n"
+            "        \"\\n\");\n");
+    fprintf(fp, "    goto dispatch;\n");
+}
+
+/*
+Emit the block starting at leader 'start': a timer check, the straight-line
+body, and the counter update before the terminator (or fall-through).
+*/
+void emit_block(FILE* fp, uint32_t* mem, int size, uint8_t* leader, int start) {
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    int end = block_end(mem, size, leader, start), len = end - start + 1;
+
+    fprintf(fp, "\nL_%d:\n", start);
+    fprintf(fp, "    if (counter + %d >= deadline) {\n        PC = %d;\n        goto step;\n    }\n", len, start);
+    if (coverage)
+        fprintf(fp, "    block_hit[%d] = 1;\n", start);
+    for (int i = start; i < end; i++)
+        emit_instruction(fp, mem[i], i, leader);
+
+    decode(mem[end], &opcode, &sreg, &treg, &imm);
+    if (opcode == OP_HALT) {
+        // execute() returns before timer_tick(), so halt itself is not counted
+        if (len > 1)
+            fprintf(fp, "    counter += %d;\n", len - 1);
+        fprintf(fp, "    PC = %d;\n    goto halt;\n", end);
+        return;
+    }
+    if (!is_terminator(opcode)) {
+        emit_instruction(fp, mem[end], end, leader);
+        fprintf(fp, "    counter += %d;\n", len);
+        emit_target(fp, end + 1, leader);
+        return;
+    }
+    if (opcode != OP_NOP && opcode != OP_BLEZ && opcode != OP_JMP && opcode != OP_IRET) {
+        // invalid opcode: let the single-step loop report it
+        if (len > 1)
+            fprintf(fp, "    counter += %d;\n", len - 1);
+        fprintf(fp, "    PC = %d;\n    goto step;\n", end);
+        return;
+    }
+    fprintf(fp, "    counter += %d;\n", len);
+    emit_instruction(fp, mem[end], end, leader);
+}
+
+/*
+The last address of the block starting at leader 'start': the first terminator
+or the word just before the next leader
+*/
+int block_end(uint32_t* mem, int size, uint8_t* leader, int start) {
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    int end = start;
+
+    while (1) {
+        decode(mem[end], &opcode, &sreg, &treg, &imm);
+        if (is_terminator(opcode) || end + 1 >= size || leader[end + 1])
+            return end;
+        end++;
+    }
+}
+
+void emit_instruction(FILE* fp, uint32_t instr, int addr, uint8_t* leader) {
+    uint8_t opcode, sreg, treg;
+    int8_t imm;
+    decode(instr, &opcode, &sreg, &treg, &imm);
+
+    switch (opcode) {
+    case OP_NOP:
+        fprintf(fp, "    goto L_%d;  // nop\n", addr);
+        break;
+    case OP_ADDI:
+        fprintf(fp, "    R[%d] = R[%d] + %d;\n", treg, sreg, imm);
+        break;
+    case OP_MOVEREG:
+        fprintf(fp, "    R[%d] = R[%d];\n", treg, sreg);
+        break;
+    case OP_MOVEI:
+        fprintf(fp, "    R[%d] = %d;\n", treg, imm);
+        break;
+    case OP_LW:
+        fprintf(fp, "    R[%d] = LOAD(R[%d] + %d);\n", treg, sreg, imm);
+        break;
+    case OP_SW:
+        fprintf(fp, "    STORE(R[%d] + %d, R[%d]);\n", sreg, imm, treg);
+        break;
+    case OP_BLEZ:
+        fprintf(fp, "    if (R[%d] <= 0) {\n", sreg);
+        if (coverage)
+            fprintf(fp, "        cov[%d] |= COV_TAKEN;\n", addr);
+        fprintf(fp, "    ");
+        emit_target(fp, addr + 1 + imm, leader);
+        fprintf(fp, "    }\n");
+        if (coverage)
+            fprintf(fp, "    cov[%d] |= COV_NOT_TAKEN;\n", addr);
+        emit_target(fp, addr + 1, leader);
+        break;
+    case OP_LA:
+        fprintf(fp, "    R[%d] = %d;\n", treg, addr + 1 + imm);
+        break;
+    case OP_ADD:
+        fprintf(fp, "    R[%d] = R[%d] + R[%d];\n", treg, sreg, treg);
+        break;
+    case OP_JMP:
+        emit_target(fp, addr + 1 + imm, leader);
+        break;
+    case OP_PUSH:
+        fprintf(fp, "    SP--;\n    mem[SP] = R[%d];\n", sreg);
+        break;
+    case OP_POP:
+        fprintf(fp, "    R[%d] = mem[SP];\n    SP++;\n", treg);
+        break;
+    case OP_IRET:
+        fprintf(fp, "    PC = mem[SP++];\n    PSR = mem[SP++] & ~PSR_INT_PEND;\n    goto dispatch;\n");
+        break;
+    case OP_PUT:
+        fprintf(fp, "    putchar(R[%d]);\n", sreg);
+        break;
+    case OP_XCHG:
+        // the translated program is single-core, so a plain swap is atomic
+        fprintf(fp, "    IR = LOAD(R[%d] + %d);\n    STORE(R[%d] + %d, R[%d]);\n    R[%d] = IR;\n", sreg, imm, sreg, imm,
+                treg, treg);
+        break;
+    }
+}
+
+/*
+Jump to a known guest address: directly if it is a leader, through the
+dispatcher otherwise.
+*/
+void emit_target(FILE* fp, int target, uint8_t* leader) {
+    if (target >= 0 && target < MAX_MEM_SIZE && leader[target])
+        fprintf(fp, "    goto L_%d;\n", target);
+    else
+        fprintf(fp, "    PC = %d;\n    goto dispatch;\n", target);
+}
+
+/*
+The dispatcher for computed targets and the single-step loop, which is a copy
+of fetch/decode/execute/timer_tick/check_interrupt from the simulator.
+*/
+void emit_epilogue(FILE* fp, uint32_t* mem, int size, uint8_t* leader) {
+    fprintf(fp, "\ndispatch:\n    switch (PC) {\n");
+    for (int i = 0; i < MAX_MEM_SIZE; i++)
+        if (leader[i])
+            fprintf(fp, "    case %d:\n        goto L_%d;\n", i, i);
+    fprintf(fp, "    }\n");
+
+    fprintf(fp,
+            "\nstep:\n"
+            "    if (PC >= MAX_MEM_SIZE)\n"
+            "        goto halt;\n"
+            "    IR = mem[PC];\n"
+            "    opcode = IR >> 24;\n"
+            "    sreg = IR >> 16;\n"
+            "    treg = IR >> 8;\n"
+            "    imm = (int8_t) IR;\n");
+    if (coverage)
+        fprintf(fp,
+                "    if (stop)\n"
+                "        goto halt;\n"
+                "    cov[PC] |= COV_EXEC;\n"
+                "    if (opcode == 0x%02x)\n"
+                "        cov[PC] |= (R[sreg] <= 0) ? COV_TAKEN : COV_NOT_TAKEN;\n",
+                OP_BLEZ);
+    fprintf(fp,
+            "    switch (opcode) {\n"
+            "    case 0x%02x:\n        goto halt;\n"
+            "    case 0x%02x:\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = R[sreg] + imm;\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = R[sreg];\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = imm;\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = LOAD(R[sreg] + imm);\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        STORE(R[sreg] + imm, R[treg]);\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        PC += (R[sreg] <= 0) ? 1 + imm : 1;\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = PC + 1 + imm;\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = R[sreg] + R[treg];\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        PC += 1 + imm;\n        break;\n"
+            "    case 0x%02x:\n        SP--;\n        mem[SP] = R[sreg];\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        R[treg] = mem[SP];\n        SP++;\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        PC = mem[SP++];\n        PSR = mem[SP++] & ~PSR_INT_PEND;\n        break;\n"
+            "    case 0x%02x:\n        printf(\"%%c\", R[sreg]);\n        PC++;\n        break;\n"
+            "    case 0x%02x:\n        IR = LOAD(R[sreg] + imm);\n        STORE(R[sreg] + imm, R[treg]);\n"
+            "        R[treg] = IR;\n        PC++;\n        break;\n"
+            "    default:\n        printf(\"Error: invalid opcode 0x%%x\\n\", opcode);\n        goto halt;\n"
+            "    }\n",
+            OP_HALT, OP_NOP, OP_ADDI, OP_MOVEREG, OP_MOVEI, OP_LW, OP_SW, OP_BLEZ, OP_LA, OP_ADD, OP_JMP, OP_PUSH,
+            OP_POP, OP_IRET, OP_PUT, OP_XCHG);
+    fprintf(fp,
+            "    counter++;\n"
+            "    if (counter == deadline) {\n"
+            "        deadline += TIMER_PERIOD;\n"
+            "        if (PSR & PSR_INT_EN)\n"
+            "            PSR |= PSR_INT_PEND;\n"
+            "    }\n"
+            "    if (PSR & PSR_INT_EN && PSR & PSR_INT_PEND) {\n"
+            "        mem[--SP] = PSR;\n"
+            "        mem[--SP] = PC;\n"
+            "        PSR &= 0xfffffffc;\n"
+            "        PC = mem[0];\n"
+            "    }\n"
+            "    goto dispatch;\n");
+
+    fprintf(fp, "\nhalt:\n");
+    if (dump) {
+        // The format the fuzzer (fuzz.c) compares against
+        fprintf(fp, "    fprintf(stderr, \"PC %%u PSR 0x%%x counter %%llu\\n\", PC, PSR, (unsigned long long) counter);\n");
+        fprintf(fp, "    for (int i = 0; i < 65; i++)\n        fprintf(stderr, \"R%%d %%d\\n\", i, R[i]);\n");
+        fprintf(fp, "    for (int i = 0; i < MAX_MEM_SIZE; i++)\n        fprintf(stderr, \"M%%d 0x%%08x\\n\", i, mem[i]);\n");
+    }
+    if (coverage) {
+        // Expand the block flags to the instructions of each block
+        for (int i = 0; i < size; i++)
+            if (leader[i])
+                fprintf(fp, "    if (block_hit[%d])\n        for (int i = %d; i <= %d; i++)\n            cov[i] |= COV_EXEC;\n",
+                        i, i, block_end(mem, size, leader, i));
+        fprintf(fp, "    return coverage_merge(args[1], 0x%08xu, cov, MAX_MEM_SIZE);\n}\n", image_hash);
+    } else
+        fprintf(fp, "    return 0;\n}\n");
+}